@@ -6,8 +6,8 @@
 Load< ColorProgram > color_program(LoadTagEarly);
 
 ColorProgram::ColorProgram() {
-	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
-	program = gl_compile_program(
+	//Compile vertex and fragment shaders using the convenient 'gl_acquire_program' helper function (which shares and caches programs):
+	program = gl_acquire_program(
 		//vertex shader:
 		"#version 330\n"
 		"uniform mat4 OBJECT_TO_CLIP;\n"
@@ -39,7 +39,7 @@ ColorProgram::ColorProgram() {
 }
 
 ColorProgram::~ColorProgram() {
-	glDeleteProgram(program);
+	gl_release_program(program);
 	program = 0;
 }
 
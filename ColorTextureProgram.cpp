@@ -6,8 +6,8 @@
 Load< ColorTextureProgram > color_texture_program(LoadTagEarly);
 
 ColorTextureProgram::ColorTextureProgram() {
-	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
-	program = gl_compile_program(
+	//Compile vertex and fragment shaders using the convenient 'gl_acquire_program' helper function (which shares and caches programs):
+	program = gl_acquire_program(
 		//vertex shader:
 		"#version 330\n"
 		"uniform mat4 OBJECT_TO_CLIP;\n"
@@ -53,7 +53,7 @@ ColorTextureProgram::ColorTextureProgram() {
 }
 
 ColorTextureProgram::~ColorTextureProgram() {
-	glDeleteProgram(program);
+	gl_release_program(program);
 	program = 0;
 }
 
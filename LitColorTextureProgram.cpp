@@ -44,8 +44,8 @@ Load< LitColorTextureProgram > lit_color_texture_program(LoadTagEarly, []() -> L
 });
 
 LitColorTextureProgram::LitColorTextureProgram() {
-	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
-	program = gl_compile_program(
+	//Compile vertex and fragment shaders using the convenient 'gl_acquire_program' helper function (which shares and caches programs):
+	program = gl_acquire_program(
 		//vertex shader:
 		"#version 330\n"
 		"uniform mat4 CLIP_FROM_OBJECT;\n"
@@ -154,7 +154,7 @@ LitColorTextureProgram::LitColorTextureProgram() {
 }
 
 LitColorTextureProgram::~LitColorTextureProgram() {
-	glDeleteProgram(program);
+	gl_release_program(program);
 	program = 0;
 }
 
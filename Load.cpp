@@ -2,11 +2,22 @@
 
 #include <array>
 #include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
 #include <cassert>
 
 namespace {
-	std::array< std::list< std::function< void() > >, MaxLoadTag > &get_load_lists() {
-		static std::array< std::list< std::function< void() > >, MaxLoadTag > load_lists;
+	//a load function, possibly split into a worker-thread half and a main-thread half:
+	struct LoadFunction {
+		std::function< void() > prepare; //runs on a worker thread (empty for main-thread-only functions)
+		std::function< void() > finalize; //runs on the main thread
+	};
+
+	std::array< std::list< LoadFunction >, MaxLoadTag > &get_load_lists() {
+		static std::array< std::list< LoadFunction >, MaxLoadTag > load_lists;
 		return load_lists;
 	}
 }
@@ -14,7 +25,14 @@ namespace {
 void add_load_function(LoadTag tag, std::function< void() > const &fn) {
 	auto &load_lists = get_load_lists();
 	assert(tag < load_lists.size());
-	load_lists[tag].emplace_back(fn);
+	load_lists[tag].emplace_back(LoadFunction{ nullptr, fn });
+}
+
+void add_load_function(LoadTag tag, std::function< void() > const &prepare, std::function< void() > const &finalize) {
+	auto &load_lists = get_load_lists();
+	assert(tag < load_lists.size());
+	assert(prepare);
+	load_lists[tag].emplace_back(LoadFunction{ prepare, finalize });
 }
 
 void call_load_functions() {
@@ -24,9 +42,58 @@ void call_load_functions() {
 
 	auto &load_lists = get_load_lists();
 	for (auto &fn_list : load_lists) {
-		while (!fn_list.empty()) {
-			(*fn_list.begin())(); //call first function in the list
-			fn_list.pop_front(); //remove from list
+		//gather the functions with a worker-thread half:
+		std::vector< LoadFunction * > jobs;
+		for (auto &fn : fn_list) {
+			if (fn.prepare) jobs.emplace_back(&fn);
 		}
+
+		//run the 'prepare' halves in parallel, saving any exceptions to re-throw on the main thread:
+		std::vector< std::exception_ptr > errors(jobs.size());
+		std::atomic< size_t > next_job(0);
+		auto work = [&]() {
+			for (size_t i = next_job.fetch_add(1); i < jobs.size(); i = next_job.fetch_add(1)) {
+				try {
+					jobs[i]->prepare();
+				} catch (...) {
+					errors[i] = std::current_exception();
+				}
+			}
+		};
+
+		//the main thread also takes jobs once it is done with main-thread-only functions, so start one less worker:
+		uint32_t worker_count = std::max(1U, std::thread::hardware_concurrency()) - 1;
+		worker_count = std::min(worker_count, uint32_t(jobs.size()));
+		std::vector< std::thread > workers;
+		workers.reserve(worker_count);
+		for (uint32_t w = 0; w < worker_count; ++w) {
+			workers.emplace_back(work);
+		}
+		auto join_workers = [&]() {
+			for (auto &worker : workers) {
+				worker.join();
+			}
+			workers.clear();
+		};
+
+		try {
+			//meanwhile, call main-thread-only functions in order:
+			for (auto &fn : fn_list) {
+				if (!fn.prepare) fn.finalize();
+			}
+			work();
+		} catch (...) {
+			join_workers();
+			throw;
+		}
+		join_workers();
+
+		//finish loads in the order they were added:
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			if (errors[i]) std::rethrow_exception(errors[i]);
+			if (jobs[i]->finalize) jobs[i]->finalize();
+		}
+
+		fn_list.clear();
 	}
 }
@@ -20,6 +20,16 @@
  * These functions are grouped by 'tags', which allow some sequencing of calls.
  * (particularly, this is useful for loading large data blobs [e.g. Meshes] before looking up individual elements within them.)
  *
+ * Loads that don't need OpenGL for (all of) their work can be split in two:
+ *
+ * Load< Sound::Sample > music(LoadTagDefault, []() -> Sound::Sample * {
+ *     return new Sound::Sample(data_path("music.opus")); //runs on a worker thread
+ * }, nullptr); //nothing left to do on the main thread
+ *
+ * The 'prepare' halves of all loads with the same tag run in parallel on a pool of worker threads,
+ *  then their 'finalize' halves (e.g., OpenGL uploads) run on the main thread, in registration order.
+ * So a load that depends on the result of another should use a later tag.
+ *
  */
 
 #include <functional>
@@ -37,6 +47,11 @@ enum LoadTag : uint32_t {
 // (only call *before* "call_load_functions()")
 void add_load_function(LoadTag tag, std::function< void() > const &fn);
 
+//Add a function split in two halves:
+// 'prepare' runs on a worker thread (so must not call OpenGL), then 'finalize' runs on the main thread.
+// (only call *before* "call_load_functions()")
+void add_load_function(LoadTag tag, std::function< void() > const &prepare, std::function< void() > const &finalize);
+
 //Call all loading functions:
 // (loading functions may throw exceptions if they fail.)
 // (only call *once*)
@@ -59,6 +74,20 @@ struct Load {
 		});
 	}
 
+	//Constructing a Load< T > with a 'prepare' and a 'finalize' function splits loading in two:
+	// prepare_fn builds the T on a worker thread, in parallel with other loads of the same tag (no OpenGL calls!);
+	// finalize_fn (if not nullptr) is then called on the main thread to finish it (e.g., OpenGL uploads).
+	Load(LoadTag tag, const std::function< T *() > &prepare_fn, const std::function< void(T &) > &finalize_fn) : value(nullptr) {
+		add_load_function(tag, [this,prepare_fn](){
+			this->value = prepare_fn();
+		}, [this,finalize_fn](){
+			if (!(this->value)) {
+				throw std::runtime_error("Loading failed.");
+			}
+			if (finalize_fn) finalize_fn(*const_cast< T * >(this->value));
+		});
+	}
+
 	//Make a "Load< T >" behave like a "T const *":
 	explicit operator bool() { return value != nullptr; }
 	operator T const *() { return value; }
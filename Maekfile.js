@@ -149,14 +149,30 @@ if (maek.OS === 'windows') {
 // cppFile: name of c++ file to compile
 // objFileBase (optional): base name object file to produce (if not supplied, set to options.objDir + '/' + cppFile without the extension)
 //returns objFile: objFileBase + a platform-dependant suffix ('.o' or '.obj')
+//the audio system can run without a device, so it is also linked into the headless sound stress test:
+const sound_names = [
+	maek.CPP('Sound.cpp'),
+	maek.CPP('load_wav.cpp'),
+	maek.CPP('load_opus.cpp')
+];
+
 const game_names = [
 	maek.CPP('PlayMode.cpp'),
 	maek.CPP('main.cpp'),
 	maek.CPP('LitColorTextureProgram.cpp'),
 	//maek.CPP('ColorTextureProgram.cpp'),  //not used right now, but you might want it
-	maek.CPP('Sound.cpp'),
-	maek.CPP('load_wav.cpp'),
-	maek.CPP('load_opus.cpp')
+	...sound_names
+];
+
+//memory-mapped asset files, also linked on their own into the headless chunk benchmark:
+const mapped_file_names = [
+	maek.CPP('MappedFile.cpp')
+];
+
+//the story engine doesn't use OpenGL, so it is also linked into the headless story benchmark:
+const story_names = [
+	maek.CPP('StateMachine.cpp'),
+	...mapped_file_names
 ];
 
 const common_names = [
@@ -172,7 +188,8 @@ const common_names = [
 	maek.CPP('Mode.cpp'),
 	maek.CPP('GL.cpp'),
 	maek.CPP('Load.cpp'),
-	maek.CPP('StateMachine.cpp')
+	maek.CPP('TextManager.cpp'),
+	...story_names
 ];
 
 const show_meshes_names = [
@@ -191,6 +208,18 @@ const freetype_test_names = [
 	maek.CPP('freetype-test.cpp')
 ];
 
+const chunk_bench_names = [
+	maek.CPP('chunk-bench.cpp')
+];
+
+const story_bench_names = [
+	maek.CPP('story-bench.cpp')
+];
+
+const sound_stress_names = [
+	maek.CPP('sound-stress.cpp')
+];
+
 const utility_objs = [
   	maek.CPP('parse_text.cpp')
 ];
@@ -206,8 +235,14 @@ const utility_exe = maek.LINK([...utility_objs, ...common_names], 'utility');
 
 const freetype_test_exe = maek.LINK([...freetype_test_names], 'freetype-test');
 
+const chunk_bench_exe = maek.LINK([...chunk_bench_names, ...mapped_file_names], 'chunk-bench');
+
+const story_bench_exe = maek.LINK([...story_bench_names, ...story_names], 'story-bench');
+
+const sound_stress_exe = maek.LINK([...sound_stress_names, ...sound_names], 'sound-stress');
+
 //set the default target to the game (and copy the readme files):
-maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, freetype_test_exe, utility_exe, ...copies];
+maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, freetype_test_exe, chunk_bench_exe, story_bench_exe, sound_stress_exe, utility_exe, ...copies];
 
 //Note that tasks that produce ':abstract targets' are never cached.
 // This is similar to how .PHONY targets behave in make.
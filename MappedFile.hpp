@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * A MappedFile maps a whole file into (read-only) memory, so that its
+ * contents can be used in place instead of being copied through a stream.
+ *
+ * Combined with the span-returning read_chunk() in read_write_chunk.hpp,
+ * this lets loaders get at large chunk-based assets without extra copies
+ * or heap allocations.
+ *
+ */
+
+#include <span>
+#include <string>
+
+struct MappedFile {
+	//map a file; throws if the file can't be opened or mapped:
+	MappedFile(std::string const &filename);
+	~MappedFile();
+
+	//mappings are owned, so copying is not allowed:
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+
+	//the mapped bytes (empty for an empty file):
+	std::span< char const > bytes() const { return std::span< char const >(data, size); }
+
+	std::string filename;
+
+	//-- internals ---
+	char const *data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	void *mapping_handle = nullptr; //HANDLE from CreateFileMapping (which keeps the file open)
+#endif
+};
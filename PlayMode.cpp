@@ -7,26 +7,79 @@
 #include "Load.hpp"
 #include "gl_errors.hpp"
 #include "data_path.hpp"
-#include "read_write_chunk.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
 #include <random>
-#include <fstream>
+#include <iostream>
 
-Load<StateMachine> story_states(LoadTagDefault, []() -> StateMachine const *
+static const std::string story_path = "./parsing/test.story";
+
+// Time of the story file that story_states was loaded from (taken before loading, so a rebuild during it isn't missed)
+static std::filesystem::file_time_type story_states_time;
+
+Load<StateMachine> story_states(LoadTagDefault, []() -> StateMachine *
 								{
-	std::vector<StateMachine::State> states;
+	StateMachine *machine = new StateMachine();
 
-	std::ifstream file("./parsing/test.story", std::ios::binary);
-	read_chunk(file, "stry", &states);
+	std::error_code ec;
+	story_states_time = std::filesystem::last_write_time(story_path, ec);
+	machine->load(story_path);
 
-	return new StateMachine(states); });
+	return machine; }, nullptr);
 
 PlayMode::PlayMode()
 {
-	story = StateMachine(story_states.value);
+	story = *story_states;
 	story.reset();
+
+	// The story may have been rebuilt since it was loaded at startup (e.g., when restarting after a hot reload)
+	story_file_time = story_states_time;
+	std::error_code ec;
+	std::filesystem::file_time_type time = std::filesystem::last_write_time(story_path, ec);
+	if (!ec && time != story_file_time)
+		reload_story();
+
+	check_shaped_text();
+	text.prewarm(story.current_text());
+	prewarm_choices();
+}
+
+void PlayMode::prewarm_choices()
+{
+	for (const StateMachine::Transition &transition : story.current_transitions())
+	{
+		text.prewarm(transition.text);
+		if (transition.dst_id != -1U)
+			text.prewarm(story.get_states()[transition.dst_id].text);
+	}
+}
+
+void PlayMode::check_shaped_text()
+{
+	const ShapingInfo &shaping = story.shaping_info();
+	use_shaped_text = text.can_draw_shaped(shaping);
+	if (shaping.font_size != 0 && !use_shaped_text)
+		std::cerr << "'" << story_path << "' was shaped with another font or size, shaping its text at runtime instead." << std::endl;
+}
+
+void PlayMode::reload_story()
+{
+	std::error_code ec;
+	story_file_time = std::filesystem::last_write_time(story_path, ec);
+
+	try
+	{
+		uint32_t changed = story.reload(story_path);
+		text.invalidate_layouts();
+		check_shaped_text();
+		prewarm_choices();
+		std::cout << "Reloaded '" << story_path << "': " << changed << " of " << story.get_states().size() << " states changed." << std::endl;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Failed to reload '" << story_path << "', keeping the current story: " << e.what() << std::endl;
+	}
 }
 
 PlayMode::~PlayMode()
@@ -50,6 +103,16 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 			right.pressed = true;
 			return true;
 		}
+		else if (evt.key.key >= SDLK_1 && evt.key.key <= SDLK_9)
+		{
+			choice = uint32_t(evt.key.key - SDLK_1);
+			return true;
+		}
+		else if (evt.key.key == SDLK_F5)
+		{
+			reload_requested = true;
+			return true;
+		}
 	}
 	else if (evt.type == SDL_EVENT_KEY_UP)
 	{
@@ -70,16 +133,49 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 
 void PlayMode::update(float elapsed)
 {
+	// Pick up rebuilt story files (checking the file time a couple of times a second)
+	reload_check_timer -= elapsed;
+	if (reload_check_timer <= 0.0f)
+	{
+		reload_check_timer = 0.5f;
+		std::error_code ec;
+		std::filesystem::file_time_type time = std::filesystem::last_write_time(story_path, ec);
+		if (!ec && time != story_file_time)
+			reload_requested = true;
+	}
+	if (reload_requested)
+	{
+		reload_requested = false;
+		reload_story();
+	}
+
 	{
 		if (left.pressed)
 		{
 			left.pressed = false;
-			story.switch_state(story.current_state.transitions[0]);
+			if (story.switch_state(0))
+			{
+				text.invalidate_layouts();
+				prewarm_choices();
+			}
 		}
 		else if (right.pressed)
 		{
 			right.pressed = false;
-			story.switch_state(story.current_state.transitions[1]);
+			if (story.switch_state(1))
+			{
+				text.invalidate_layouts();
+				prewarm_choices();
+			}
+		}
+		else if (choice != -1U)
+		{
+			if (story.switch_state(choice))
+			{
+				text.invalidate_layouts();
+				prewarm_choices();
+			}
+			choice = -1U;
 		}
 	}
 
@@ -100,7 +196,14 @@ void PlayMode::draw(glm::uvec2 const &drawable_size)
 	glDepthFunc(GL_LESS); // this is the default depth comparison function, but FYI you can change it.
 
 	{
-		story.draw_current_state(drawable_size, glm::vec2(36.0f, 36.0f), glm::vec3(1.0f, 1.0f, 1.0f));
+		std::span<const ShapedText> shaped;
+		if (use_shaped_text)
+			shaped = story.current_shaped_text();
+		// Keep the text the same size on high-DPI displays (the glyphs scale without blurring)
+		float density = SDL_GetWindowPixelDensity(Mode::window);
+		if (density <= 0.0f)
+			density = 1.0f;
+		text.draw_text(story.current_text(), drawable_size, glm::vec2(36.0f, 36.0f) * density, 36.0f * density, glm::vec3(1.0f, 1.0f, 1.0f), shaped);
 	}
 	GL_ERRORS();
 }
@@ -7,8 +7,10 @@
 
 #include <vector>
 #include <deque>
+#include <filesystem>
 
 #include "StateMachine.hpp"
+#include "TextManager.hpp"
 
 struct PlayMode : Mode
 {
@@ -29,5 +31,22 @@ struct PlayMode : Mode
 		uint8_t pressed = 0;
 	} left, right, down, up;
 
+	// Transition picked with the number keys (1 is the first), -1U if none
+	uint32_t choice = -1U;
+
 	StateMachine story;
+	TextManager text;
+
+	// The story file is reloaded when it is rebuilt (or when F5 is pressed), keeping the current state
+	std::filesystem::file_time_type story_file_time;
+	float reload_check_timer = 0.0f;
+	bool reload_requested = false;
+	void reload_story();
+
+	// Whether the story's pre-shaped glyphs match the font used to draw it (otherwise the text is shaped at runtime)
+	bool use_shaped_text = false;
+	void check_shaped_text();
+
+	// Have the glyphs of every choice (and where it leads) rasterized before one is taken
+	void prewarm_choices();
 };
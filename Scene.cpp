@@ -2,14 +2,28 @@
 
 #include "gl_errors.hpp"
 #include "read_write_chunk.hpp"
+#include "MappedFile.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
 #include <fstream>
+#include <streambuf>
+#include <bit>
+
+namespace {
+	//read-only stream buffer over a block of memory, used to hand the end of a mapped file to load_extra:
+	struct SpanStreamBuf : std::streambuf {
+		SpanStreamBuf(std::span< char const > data) {
+			char *begin = const_cast< char * >(data.data());
+			setg(begin, begin, begin + data.size());
+		}
+	};
+}
 
 //-------------------------
 
-glm::mat4x3 Scene::Transform::make_parent_from_local() const {
+//matrices of a transformation stored in the transform arrays:
+static glm::mat4x3 make_parent_from_local(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale) {
 	//compute:
 	//   translate   *   rotate    *   scale
 	// [ 1 0 0 p.x ]   [       0 ]   [ s.x 0 0 0 ]
@@ -26,7 +40,7 @@ glm::mat4x3 Scene::Transform::make_parent_from_local() const {
 	);
 }
 
-glm::mat4x3 Scene::Transform::make_local_from_parent() const {
+static glm::mat4x3 make_local_from_parent(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale) {
 	//compute:
 	//   1/scale       *    rot^-1   *  translate^-1
 	// [ 1/s.x 0 0 0 ]   [       0 ]   [ 0 0 0 -p.x ]
@@ -56,19 +70,123 @@ glm::mat4x3 Scene::Transform::make_local_from_parent() const {
 	);
 }
 
+static glm::mat4x3 make_parent_from_local(Scene::Transforms const &transforms, uint32_t index) {
+	return make_parent_from_local(transforms.positions[index], transforms.rotations[index], transforms.scales[index]);
+}
+
+static glm::mat4x3 make_local_from_parent(Scene::Transforms const &transforms, uint32_t index) {
+	return make_local_from_parent(transforms.positions[index], transforms.rotations[index], transforms.scales[index]);
+}
+
+//-------------------------
+
+//the world matrices of the transform and its children need to be recomputed:
+static void mark_dirty(Scene::Transforms &transforms, uint32_t index) {
+	transforms.dirty[index] = 1;
+	transforms.any_dirty = true;
+}
+
+void Scene::Transform::set_position(glm::vec3 const &position) {
+	scene->transforms.positions[index] = position;
+	mark_dirty(scene->transforms, index);
+}
+
+void Scene::Transform::set_rotation(glm::quat const &rotation) {
+	scene->transforms.rotations[index] = rotation;
+	mark_dirty(scene->transforms, index);
+}
+
+void Scene::Transform::set_scale(glm::vec3 const &scale) {
+	scene->transforms.scales[index] = scale;
+	mark_dirty(scene->transforms, index);
+}
+
+Scene::Transform Scene::Transform::parent() const {
+	uint32_t parent = scene->transforms.parents[index];
+	if (parent == -1U) return Transform();
+	return Transform{scene, parent};
+}
+
+void Scene::Transform::set_parent(Transform parent) {
+	if (parent) {
+		//parents coming first is what lets update_world_transforms() work in a single pass:
+		if (parent.scene != scene || parent.index >= index) {
+			throw std::runtime_error("transform '" + std::string(name()) + "' can only have a parent from the same scene that comes before it.");
+		}
+	}
+	scene->transforms.parents[index] = (parent ? parent.index : -1U);
+	mark_dirty(scene->transforms, index);
+}
+
+glm::mat4x3 Scene::Transform::make_parent_from_local() const {
+	return ::make_parent_from_local(scene->transforms, index);
+}
+
+glm::mat4x3 Scene::Transform::make_local_from_parent() const {
+	return ::make_local_from_parent(scene->transforms, index);
+}
+
 glm::mat4x3 Scene::Transform::make_world_from_local() const {
-	if (!parent) {
-		return make_parent_from_local();
-	} else {
-		return parent->make_world_from_local() * glm::mat4(make_parent_from_local()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+	Transforms const &transforms = scene->transforms;
+	if (!transforms.any_dirty) {
+		return transforms.world_from_local[index];
+	}
+	//something changed since the last update, so compute it along the parent chain:
+	glm::mat4x3 world_from_local = ::make_parent_from_local(transforms, index);
+	for (uint32_t p = transforms.parents[index]; p != -1U; p = transforms.parents[p]) {
+		world_from_local = ::make_parent_from_local(transforms, p) * glm::mat4(world_from_local); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
 	}
+	return world_from_local;
 }
+
 glm::mat4x3 Scene::Transform::make_local_from_world() const {
-	if (!parent) {
-		return make_local_from_parent();
-	} else {
-		return make_local_from_parent() * glm::mat4(parent->make_local_from_world()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+	Transforms const &transforms = scene->transforms;
+	glm::mat4x3 local_from_world = ::make_local_from_parent(transforms, index);
+	for (uint32_t p = transforms.parents[index]; p != -1U; p = transforms.parents[p]) {
+		local_from_world = local_from_world * glm::mat4(::make_local_from_parent(transforms, p)); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
 	}
+	return local_from_world;
+}
+
+Scene::Transform Scene::add_transform(std::string_view name, Transform parent) {
+	assert(!parent || parent.scene == this);
+
+	transforms.name_ranges.emplace_back(uint32_t(transforms.name_chars.size()), uint32_t(transforms.name_chars.size() + name.size()));
+	transforms.name_chars.insert(transforms.name_chars.end(), name.begin(), name.end());
+	transforms.positions.emplace_back(0.0f, 0.0f, 0.0f);
+	transforms.rotations.emplace_back(1.0f, 0.0f, 0.0f, 0.0f); //n.b. wxyz init order
+	transforms.scales.emplace_back(1.0f, 1.0f, 1.0f);
+	transforms.parents.emplace_back(parent ? parent.index : -1U);
+	transforms.world_from_local.emplace_back(1.0f);
+	transforms.dirty.emplace_back(0);
+
+	uint32_t index = transforms.size() - 1;
+	mark_dirty(transforms, index);
+	return Transform{this, index};
+}
+
+Scene::Transform Scene::add_transform(std::string_view name) {
+	return add_transform(name, Transform());
+}
+
+void Scene::update_world_transforms() const {
+	if (!transforms.any_dirty) return;
+
+	//parents come before their children, so their matrices (and dirty flags) are already updated when a child is reached:
+	for (uint32_t i = 0; i < transforms.size(); ++i) {
+		uint32_t parent = transforms.parents[i];
+		if (parent != -1U && transforms.dirty[parent]) transforms.dirty[i] = 1;
+		if (!transforms.dirty[i]) continue;
+
+		if (parent == -1U) {
+			transforms.world_from_local[i] = ::make_parent_from_local(transforms, i);
+		} else {
+			transforms.world_from_local[i] = transforms.world_from_local[parent] * glm::mat4(::make_parent_from_local(transforms, i)); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+		}
+	}
+
+	std::fill(transforms.dirty.begin(), transforms.dirty.end(), 0);
+	transforms.any_dirty = false;
 }
 
 //-------------------------
@@ -82,14 +200,40 @@ glm::mat4 Scene::Camera::make_projection() const {
 
 void Scene::draw(Camera const &camera) const {
 	assert(camera.transform);
-	glm::mat4 clip_from_world = camera.make_projection() * glm::mat4(camera.transform->make_local_from_world());
+	glm::mat4 clip_from_world = camera.make_projection() * glm::mat4(camera.transform.make_local_from_world());
 	glm::mat4x3 light_from_world = glm::mat4x3(1.0f);
 	draw(clip_from_world, light_from_world);
 }
 
+//stable least-significant-byte-first radix sort of draw items by one of their keys:
+// (bytes that are the same in every key are skipped, so small GL names only take one pass)
+static void radix_sort(std::vector< Scene::DrawItem > &items, std::vector< Scene::DrawItem > &scratch, uint32_t Scene::DrawItem::*key) {
+	if (items.empty()) return;
+	scratch.resize(items.size());
+	for (uint32_t shift = 0; shift < 32; shift += 8) {
+		uint32_t offsets[256] = {};
+		for (auto const &item : items) {
+			offsets[(item.*key >> shift) & 0xff] += 1;
+		}
+		if (offsets[(items[0].*key >> shift) & 0xff] == items.size()) continue;
+
+		uint32_t total = 0;
+		for (auto &offset : offsets) {
+			uint32_t count = offset;
+			offset = total;
+			total += count;
+		}
+		for (auto const &item : items) {
+			scratch[offsets[(item.*key >> shift) & 0xff]++] = item;
+		}
+		items.swap(scratch);
+	}
+}
+
 void Scene::draw(glm::mat4 const &clip_from_world, glm::mat4x3 const &light_from_world) const {
 
-	//Iterate through all drawables, sending each one to OpenGL:
+	//Gather all drawables that can be drawn, along with their sort keys:
+	draw_queue.clear();
 	for (auto const &drawable : drawables) {
 		//Reference to drawable's pipeline for convenience:
 		Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
@@ -101,18 +245,60 @@ void Scene::draw(glm::mat4 const &clip_from_world, glm::mat4x3 const &light_from
 		//skip any drawables that don't contain any vertices:
 		if (pipeline.count == 0) continue;
 
+		//the object-to-world matrix is used for sorting and in all three matrix uniforms:
+		assert(drawable.transform); //drawables *must* have a transform
+		//(only the world matrices of transforms that changed since the last frame are recomputed,
+		// and a drawable may refer to a transform of another scene)
+		Scene const &owner = *drawable.transform.scene;
+		owner.update_world_transforms();
+		glm::mat4x3 const &world_from_object = owner.transforms.world_from_local[drawable.transform.index];
+
+		//depth of the drawable's origin, so nearer drawables are drawn first (and hide more of the ones behind):
+		float w = (clip_from_world * glm::vec4(world_from_object[3], 1.0f)).w;
+		if (!(w > 0.0f)) w = 0.0f; //(behind the camera, or NaN)
+
+		draw_queue.emplace_back(DrawItem{
+			.program = pipeline.program,
+			.vao = pipeline.vao,
+			.texture = pipeline.textures[0].texture,
+			.depth = std::bit_cast< uint32_t >(w),
+			.drawable = &drawable,
+			.world_from_object = &world_from_object
+		});
+	}
+
+	//Sort by program, then vertex array, then texture, then depth (least significant key first, since each pass is stable):
+	radix_sort(draw_queue, draw_queue_scratch, &DrawItem::depth);
+	radix_sort(draw_queue, draw_queue_scratch, &DrawItem::texture);
+	radix_sort(draw_queue, draw_queue_scratch, &DrawItem::vao);
+	radix_sort(draw_queue, draw_queue_scratch, &DrawItem::program);
+
+	//State set by the previous drawable, so that it is only changed when needed:
+	GLuint bound_program = 0;
+	GLuint bound_vao = 0;
+	Drawable::Pipeline::TextureInfo bound_textures[Drawable::Pipeline::TextureCount];
+
+	//Send each drawable to OpenGL:
+	for (auto const &item : draw_queue) {
+		//Reference to drawable's pipeline for convenience:
+		Scene::Drawable::Pipeline const &pipeline = item.drawable->pipeline;
 
 		//Set shader program:
-		glUseProgram(pipeline.program);
+		if (pipeline.program != bound_program) {
+			glUseProgram(pipeline.program);
+			bound_program = pipeline.program;
+		}
 
 		//Set attribute sources:
-		glBindVertexArray(pipeline.vao);
+		if (pipeline.vao != bound_vao) {
+			glBindVertexArray(pipeline.vao);
+			bound_vao = pipeline.vao;
+		}
 
 		//Configure program uniforms:
 
 		//the object-to-world matrix is used in all three of these uniforms:
-		assert(drawable.transform); //drawables *must* have a transform
-		glm::mat4x3 world_from_object = drawable.transform->make_world_from_local();
+		glm::mat4x3 const &world_from_object = *item.world_from_object;
 
 		//CLIP_FROM_OBJECT takes vertices from object space to clip space:
 		if (pipeline.CLIP_FROM_OBJECT_mat4 != -1U) {
@@ -137,27 +323,33 @@ void Scene::draw(glm::mat4 const &clip_from_world, glm::mat4x3 const &light_from
 		//set any requested custom uniforms:
 		if (pipeline.set_uniforms) pipeline.set_uniforms();
 
-		//set up textures:
+		//set up textures (units the drawable doesn't use are left empty, as if each drawable started from scratch):
 		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, pipeline.textures[i].texture);
+			Drawable::Pipeline::TextureInfo const &want = pipeline.textures[i];
+			Drawable::Pipeline::TextureInfo &bound = bound_textures[i];
+			if (want.texture == bound.texture && (want.texture == 0 || want.target == bound.target)) continue;
+			glActiveTexture(GL_TEXTURE0 + i);
+			if (bound.texture != 0 && (want.texture == 0 || want.target != bound.target)) {
+				glBindTexture(bound.target, 0);
+			}
+			if (want.texture != 0) {
+				glBindTexture(want.target, want.texture);
 			}
+			bound = want;
 		}
 
 		//draw the object:
 		glDrawArrays(pipeline.type, pipeline.start, pipeline.count);
+	}
 
-		//un-bind textures:
-		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, 0);
-			}
+	//un-bind textures:
+	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+		if (bound_textures[i].texture != 0) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(bound_textures[i].target, 0);
 		}
-		glActiveTexture(GL_TEXTURE0);
-
 	}
+	glActiveTexture(GL_TEXTURE0);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
@@ -167,12 +359,14 @@ void Scene::draw(glm::mat4 const &clip_from_world, glm::mat4x3 const &light_from
 
 
 void Scene::load(std::string const &filename,
-	std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable) {
+	std::function< void(Scene &, Transform, std::string const &) > const &on_drawable) {
 
-	std::ifstream file(filename, std::ios::binary);
+	//chunks are read in place from the mapped file when they are suitably aligned:
+	MappedFile file(filename);
+	ChunkCursor cursor(file.bytes());
 
-	std::vector< char > names;
-	read_chunk(file, "str0", &names);
+	std::vector< char > names_storage;
+	std::span< char const > names = read_chunk(cursor, "str0", &names_storage);
 
 	struct HierarchyEntry {
 		uint32_t parent;
@@ -183,8 +377,8 @@ void Scene::load(std::string const &filename,
 		glm::vec3 scale;
 	};
 	static_assert(sizeof(HierarchyEntry) == 4 + 4 + 4 + 4*3 + 4*4 + 4*3, "HierarchyEntry is packed.");
-	std::vector< HierarchyEntry > hierarchy;
-	read_chunk(file, "xfh0", &hierarchy);
+	std::vector< HierarchyEntry > hierarchy_storage;
+	std::span< HierarchyEntry const > hierarchy = read_chunk(cursor, "xfh0", &hierarchy_storage);
 
 	struct MeshEntry {
 		uint32_t transform;
@@ -192,8 +386,8 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(MeshEntry) == 4 + 4 + 4, "MeshEntry is packed.");
-	std::vector< MeshEntry > meshes;
-	read_chunk(file, "msh0", &meshes);
+	std::vector< MeshEntry > meshes_storage;
+	std::span< MeshEntry const > meshes = read_chunk(cursor, "msh0", &meshes_storage);
 
 	struct CameraEntry {
 		uint32_t transform;
@@ -202,8 +396,8 @@ void Scene::load(std::string const &filename,
 		float clip_near, clip_far;
 	};
 	static_assert(sizeof(CameraEntry) == 4 + 4 + 4 + 4 + 4, "CameraEntry is packed.");
-	std::vector< CameraEntry > loaded_cameras;
-	read_chunk(file, "cam0", &loaded_cameras);
+	std::vector< CameraEntry > loaded_cameras_storage;
+	std::span< CameraEntry const > loaded_cameras = read_chunk(cursor, "cam0", &loaded_cameras_storage);
 
 	struct LightEntry {
 		uint32_t transform;
@@ -214,35 +408,34 @@ void Scene::load(std::string const &filename,
 		float fov;
 	};
 	static_assert(sizeof(LightEntry) == 4 + 1 + 3 + 4 + 4 + 4, "LightEntry is packed.");
-	std::vector< LightEntry > loaded_lights;
-	read_chunk(file, "lmp0", &loaded_lights);
+	std::vector< LightEntry > loaded_lights_storage;
+	std::span< LightEntry const > loaded_lights = read_chunk(cursor, "lmp0", &loaded_lights_storage);
 
 
 	//--------------------------------
 	//Now that file is loaded, create transforms for hierarchy entries:
 
-	std::vector< Transform * > hierarchy_transforms;
+	std::vector< Transform > hierarchy_transforms;
 	hierarchy_transforms.reserve(hierarchy.size());
 
 	for (auto const &h : hierarchy) {
-		transforms.emplace_back();
-		Transform *t = &transforms.back();
+		Transform parent;
 		if (h.parent != -1U) {
 			if (h.parent >= hierarchy_transforms.size()) {
 				throw std::runtime_error("scene file '" + filename + "' did not contain transforms in topological-sort order.");
 			}
-			t->parent = hierarchy_transforms[h.parent];
+			parent = hierarchy_transforms[h.parent];
 		}
 
-		if (h.name_begin <= h.name_end && h.name_end <= names.size()) {
-			t->name = std::string(names.begin() + h.name_begin, names.begin() + h.name_end);
-		} else {
+		if (!(h.name_begin <= h.name_end && h.name_end <= names.size())) {
 				throw std::runtime_error("scene file '" + filename + "' contains hierarchy entry with invalid name indices");
 		}
 
-		t->position = h.position;
-		t->rotation = h.rotation;
-		t->scale = h.scale;
+		//(the file's topological order is also the order the transform arrays need)
+		Transform t = add_transform(std::string_view(names.data() + h.name_begin, h.name_end - h.name_begin), parent);
+		transforms.positions[t.index] = h.position;
+		transforms.rotations[t.index] = h.rotation;
+		transforms.scales[t.index] = h.scale;
 
 		hierarchy_transforms.emplace_back(t);
 	}
@@ -302,9 +495,13 @@ void Scene::load(std::string const &filename,
 	}
 
 	//load any extra that a subclass wants:
-	load_extra(file, names, hierarchy_transforms);
+	// (the stream reads the rest of the mapped file without copying it)
+	std::span< char const > extra = cursor.remaining();
+	SpanStreamBuf extra_buf(extra);
+	std::istream extra_stream(&extra_buf);
+	load_extra(extra_stream, names, hierarchy_transforms);
 
-	if (file.peek() != EOF) {
+	if (extra_stream.peek() != EOF) {
 		std::cerr << "WARNING: trailing data in scene file '" << filename << "'" << std::endl;
 	}
 
@@ -314,7 +511,7 @@ void Scene::load(std::string const &filename,
 
 //-------------------------
 
-Scene::Scene(std::string const &filename, std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable) {
+Scene::Scene(std::string const &filename, std::function< void(Scene &, Transform, std::string const &) > const &on_drawable) {
 	load(filename, on_drawable);
 }
 
@@ -327,51 +524,31 @@ Scene &Scene::operator=(Scene const &other) {
 	return *this;
 }
 
-void Scene::set(Scene const &other, std::unordered_map< Transform const *, Transform * > *transform_map_) {
-
-	std::unordered_map< Transform const *, Transform * > t2t_temp;
-	std::unordered_map< Transform const *, Transform * > &transform_to_transform = *(transform_map_ ? transform_map_ : &t2t_temp);
-
-	transform_to_transform.clear();
-
-	//null transform maps to itself:
-	transform_to_transform.insert(std::make_pair(nullptr, nullptr));
-
-	//Copy transforms and store mapping:
-	transforms.clear();
-	for (auto const &t : other.transforms) {
-		transforms.emplace_back();
-		transforms.back().name = t.name;
-		transforms.back().position = t.position;
-		transforms.back().rotation = t.rotation;
-		transforms.back().scale = t.scale;
-		transforms.back().parent = t.parent; //will update later
+void Scene::set(Scene const &other) {
+	//transforms are copied array by array (no pointers to fix up, since they refer to each other by index):
+	transforms = other.transforms;
 
-		//store mapping between transforms old and new:
-		auto ret = transform_to_transform.insert(std::make_pair(&t, &transforms.back()));
-		assert(ret.second);
-	}
-
-	//update transform parents:
-	for (auto &t : transforms) {
-		t.parent = transform_to_transform.at(t.parent);
-	}
+	//handles to the other scene's transforms become handles to the same transforms here:
+	// (handles to transforms of some third scene are left as they are)
+	auto rebase = [this, &other](Transform &transform) {
+		if (transform.scene == &other) transform.scene = this;
+	};
 
-	//copy other's drawables, updating transform pointers:
+	//copy other's drawables, updating transform handles:
 	drawables = other.drawables;
 	for (auto &d : drawables) {
-		d.transform = transform_to_transform.at(d.transform);
+		rebase(d.transform);
 	}
 
-	//copy other's cameras, updating transform pointers:
+	//copy other's cameras, updating transform handles:
 	cameras = other.cameras;
 	for (auto &c : cameras) {
-		c.transform = transform_to_transform.at(c.transform);
+		rebase(c.transform);
 	}
 
-	//copy other's lights, updating transform pointers:
+	//copy other's lights, updating transform handles:
 	lights = other.lights;
 	for (auto &l : lights) {
-		l.transform = transform_to_transform.at(l.transform);
+		rebase(l.transform);
 	}
 }
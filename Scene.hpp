@@ -16,43 +16,84 @@
 #include <glm/gtc/quaternion.hpp>
 
 #include <list>
+#include <span>
 #include <memory>
 #include <functional>
 #include <string>
 #include <vector>
-#include <unordered_map>
+#include <string_view>
 
 struct Scene {
-	struct Transform {
+	//Transforms are stored as parallel arrays, one element per transform, so passes over them
+	// read contiguous memory and copying a scene's transforms is a copy of a few arrays:
+	struct Transforms {
 		//Transform names are useful for debugging and looking up locations in a loaded scene:
-		std::string name;
+		// (stored back to back; transform i's name is name_chars[ name_ranges[i].x, name_ranges[i].y ) )
+		std::vector< char > name_chars;
+		std::vector< glm::uvec2 > name_ranges;
 
 		//The core function of a transform is to store a transformation in the world:
-		glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
-		glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f); //n.b. wxyz init order
-		glm::vec3 scale = glm::vec3(1.0f, 1.0f, 1.0f);
+		std::vector< glm::vec3 > positions;
+		std::vector< glm::quat > rotations;
+		std::vector< glm::vec3 > scales;
+
+		//The transformation may be relative to a parent transform, which always comes earlier in the arrays:
+		std::vector< uint32_t > parents; //index of the parent, or -1U for none
+
+		//World matrices, cached by update_world_transforms():
+		mutable std::vector< glm::mat4x3 > world_from_local;
+		mutable std::vector< uint8_t > dirty; //transform changed since its world matrix was computed
+		mutable bool any_dirty = false;
+
+		uint32_t size() const { return uint32_t(positions.size()); }
+		std::string_view name(uint32_t index) const {
+			return std::string_view(name_chars.data() + name_ranges[index].x, name_ranges[index].y - name_ranges[index].x);
+		}
+	};
+
+	//A 'Transform' is a handle to a transform of a scene; it stays valid as transforms are added:
+	struct Transform {
+		Scene *scene = nullptr;
+		uint32_t index = -1U;
+
+		explicit operator bool() const { return scene != nullptr; }
+		bool operator==(Transform const &) const = default;
+
+		std::string_view name() const { return scene->transforms.name(index); }
 
-		//The transform above may be relative to some parent transform:
-		Transform *parent = nullptr;
+		//Transformation relative to the parent (setting it marks the world matrices to update):
+		glm::vec3 const &position() const { return scene->transforms.positions[index]; }
+		glm::quat const &rotation() const { return scene->transforms.rotations[index]; }
+		glm::vec3 const &scale() const { return scene->transforms.scales[index]; }
+		void set_position(glm::vec3 const &position);
+		void set_rotation(glm::quat const &rotation);
+		void set_scale(glm::vec3 const &scale);
+
+		Transform parent() const;
+		//the parent must be in the same scene, before this transform (e.g., added earlier):
+		// throws otherwise
+		void set_parent(Transform parent);
 
 		//It is often convenient to construct matrices representing this transformation:
 		// ..relative to its parent:
 		glm::mat4x3 make_parent_from_local() const;
 		glm::mat4x3 make_local_from_parent() const;
-		// ..relative to the world:
+		// ..relative to the world (the cached matrix, unless something changed since update_world_transforms()):
 		glm::mat4x3 make_world_from_local() const;
 		glm::mat4x3 make_local_from_world() const;
-
-		//since hierarchy is tracked through pointers, copy-constructing a transform  is not advised:
-		Transform(Transform const &) = delete;
-		//if we delete some constructors, we need to let the compiler know that the default constructor is still okay:
-		Transform() = default;
 	};
 
+	//add a transform at the end of the arrays (parent must be in this scene, or empty for none):
+	Transform add_transform(std::string_view name, Transform parent);
+	Transform add_transform(std::string_view name = "");
+
+	//handle to transform 'index' of the arrays:
+	Transform transform(uint32_t index) { assert(index < transforms.size()); return Transform{this, index}; }
+
 	struct Drawable {
 		//a 'Drawable' attaches attribute data to a transform:
-		Drawable(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Drawable(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
 
 		//Contains all the data needed to run the OpenGL pipeline:
 		struct Pipeline {
@@ -83,8 +124,8 @@ struct Scene {
 
 	struct Camera {
 		//a 'Camera' attaches camera data to a transform:
-		Camera(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Camera(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
 		//NOTE: cameras are directed along their -z axis
 
 		//perspective camera parameters:
@@ -97,8 +138,8 @@ struct Scene {
 
 	struct Light {
 		//a 'Light' attaches light data to a transform:
-		Light(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Light(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
 		//NOTE: directional, spot, and hemisphere lights are directed along their -z axis
 
 		enum Type : char {
@@ -117,37 +158,56 @@ struct Scene {
 	};
 
 	//Scenes, of course, may have many of the above objects:
-	std::list< Transform > transforms;
+	// (transforms are in 'transforms', above; the others are referred to by pointer, so they stay in lists)
+	Transforms transforms;
 	std::list< Drawable > drawables;
 	std::list< Camera > cameras;
 	std::list< Light > lights;
 
 	//The "draw" function provides a convenient way to pass all the things in a scene to OpenGL:
+	// (drawables are drawn sorted by program, vertex array, first texture, then front-to-back,
+	//  and only the state that differs from the previous drawable is set)
 	void draw(Camera const &camera) const;
 
 	//..sometimes, you want to draw with a custom projection matrix and/or light space:
 	void draw(glm::mat4 const &clip_from_world, glm::mat4x3 const &light_from_world = glm::mat4x3(1.0f)) const;
 
+	//bring the cached world matrices up to date in one pass over the transforms (parents come first),
+	// only recomputing the matrices of transforms that changed (or whose parents did):
+	// (returns right away if nothing changed, so static scenery costs nothing)
+	void update_world_transforms() const;
+
+	//one drawable waiting to be drawn, along with the keys it is sorted by:
+	struct DrawItem {
+		uint32_t program, vao, texture; //GL names from the drawable's pipeline
+		uint32_t depth; //bits of the (non-negative) clip-space w of the drawable's origin, which sort like the float
+		Drawable const *drawable;
+		glm::mat4x3 const *world_from_object; //cached in the arrays of the drawable's transform's scene
+	};
+	//render queue, rebuilt by every draw() (kept here so its storage is reused):
+	mutable std::vector< DrawItem > draw_queue, draw_queue_scratch;
+
 	//add transforms/objects/cameras from a scene file to this scene:
 	// the 'on_drawable' callback gives your code a chance to look up mesh data and make Drawables:
 	// throws on file format errors
 	void load(std::string const &filename,
-		std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable = nullptr
+		std::function< void(Scene &, Transform, std::string const &) > const &on_drawable = nullptr
 	);
 
 	//this function is called to read extra chunks from the scene file after the main chunks are read:
 	// this is useful if you, e.g., subclassing scene to represent a game level/area
-	virtual void load_extra(std::istream &from, std::vector< char > const &str0, std::vector< Transform * > const &xfh0) { }
+	// (str0 points into the mapped scene file, so it is only valid during the call)
+	virtual void load_extra(std::istream &from, std::span< char const > str0, std::vector< Transform > const &xfh0) { }
 
 	//empty scene:
 	Scene() = default;
 
 	//load a scene:
-	Scene(std::string const &filename, std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable);
+	Scene(std::string const &filename, std::function< void(Scene &, Transform, std::string const &) > const &on_drawable);
 
-	//copy a scene (with proper pointer fixup):
+	//copy a scene (transform arrays are copied as they are, so a transform keeps its index in the copy):
 	Scene(Scene const &); //...as a constructor
 	Scene &operator=(Scene const &); //...as scene = scene
-	//... as a set() function that optionally returns the transform->transform mapping:
-	void set(Scene const &, std::unordered_map< Transform const *, Transform * > *transform_map = nullptr);
+	//... as a set() function:
+	void set(Scene const &);
 };
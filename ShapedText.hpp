@@ -0,0 +1,46 @@
+#pragma once
+
+#include <span>
+#include <string_view>
+#include <stdint.h>
+
+// Text shaped ahead of time by the story compiler (parse_text --shape), so that TextManager
+// only has to break lines and emit quads when drawing it.
+
+// One glyph of a shaped text, with positions in 26.6 fixed point pixels (as HarfBuzz reports them)
+struct ShapedGlyph
+{
+    uint32_t gid;     // Glyph index in the font (TextManager keeps the index of a fallback font in the high bits)
+    uint32_t cluster; // Byte offset in the text of the characters this glyph was shaped from
+    int32_t x_advance;
+    int32_t x_offset, y_offset;
+};
+static_assert(sizeof(ShapedGlyph) == 5 * 4, "ShapedGlyph is packed.");
+
+// Font and size a text was shaped with, the glyphs are only valid for that same font file and size
+struct ShapingInfo
+{
+    uint32_t font_size = 0; // Pixels per em, 0 if nothing was shaped
+    uint32_t padding = 0;
+    uint64_t font_hash = 0; // hash_font_data() of the font file
+};
+static_assert(sizeof(ShapingInfo) == 16, "ShapingInfo is packed.");
+
+// A text along with its glyphs
+struct ShapedText
+{
+    std::string_view text;
+    std::span<const ShapedGlyph> glyphs;
+};
+
+// FNV-1a hash of the contents of a font file
+inline uint64_t hash_font_data(std::span<const char> data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : data)
+    {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
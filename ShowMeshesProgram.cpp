@@ -18,8 +18,8 @@ Load< ShowMeshesProgram > show_meshes_program(LoadTagEarly, []() -> ShowMeshesPr
 });
 
 ShowMeshesProgram::ShowMeshesProgram() {
-	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
-	program = gl_compile_program(
+	//Compile vertex and fragment shaders using the convenient 'gl_acquire_program' helper function (which shares and caches programs):
+	program = gl_acquire_program(
 		//vertex shader:
 		"#version 330\n"
 		"uniform mat4 CLIP_FROM_OBJECT;\n"
@@ -88,7 +88,7 @@ ShowMeshesProgram::ShowMeshesProgram() {
 }
 
 ShowMeshesProgram::~ShowMeshesProgram() {
-	glDeleteProgram(program);
+	gl_release_program(program);
 	program = 0;
 }
 
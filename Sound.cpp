@@ -4,11 +4,30 @@
 
 #include <SDL3/SDL.h>
 
-#include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <exception>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+//stereo pair of values (an output frame, or per-channel gains):
+struct LR {
+	float l;
+	float r;
+};
+static_assert(sizeof(LR) == 8, "Sample is packed");
 
 //local (to this file) data used by the audio system:
 namespace {
@@ -19,8 +38,111 @@ namespace {
 	//The audio device:
 	SDL_AudioStream *stream = nullptr;
 
-	//list of all currently playing samples:
-	std::list< std::shared_ptr< Sound::PlayingSample > > playing_samples;
+	//...or, with no device, whether mix_headless() stands in for it (see Sound::init_headless()):
+	bool headless = false;
+	std::mutex headless_mutex; //held by mix_headless() and Sound::lock(), as SDL locks the stream
+
+	//Voices that samples play in, stored as parallel arrays indexed by voice:
+	struct VoicePool {
+		//Shared between threads -- each voice's generation (upper bits) and whether it is in use (low bit).
+		// the game thread claims a voice by bumping its generation and setting the low bit;
+		// the audio callback frees it by clearing the low bit, unless the voice was claimed again in the meantime.
+		std::array< std::atomic< uint32_t >, Sound::MaxVoices > state{};
+		//how loud each voice was in the last mix (used when choosing a voice to take over):
+		std::array< std::atomic< float >, Sound::MaxVoices > loudness{};
+
+		//Only used by the game thread:
+		std::array< int, Sound::MaxVoices > priority{};
+		uint32_t next_claim = 0; //where to start looking for a free voice
+
+		//Only used by the audio callback (or while the audio stream is locked):
+		std::array< uint32_t, Sound::MaxVoices > active{}; //indices of playing voices, in no particular order
+		uint32_t active_count = 0;
+		std::array< bool, Sound::MaxVoices > playing{}; //is voice in 'active'?
+		std::array< uint32_t, Sound::MaxVoices > generation{}; //generation the voice is playing for
+
+		std::array< std::vector< float > const *, Sound::MaxVoices > data{}; //sample data being played
+		std::array< std::shared_ptr< OpusStream >, Sound::MaxVoices > stream{}; //decoded samples of a streamed sample (used instead of 'data' if set)
+		std::array< uint32_t, Sound::MaxVoices > i{}; //next data value to read
+		std::array< bool, Sound::MaxVoices > is_3D{}; //was sample played in "3D" mode?
+		std::array< bool, Sound::MaxVoices > loop{}; //should playback loop after data runs out?
+		std::array< bool, Sound::MaxVoices > stopping{}; //is playing stopping?
+
+		std::array< Sound::Ramp< float >, Sound::MaxVoices > volume{};
+		std::array< Sound::Ramp< float >, Sound::MaxVoices > pan{}; //2D playback panning control
+		std::array< Sound::Ramp< glm::vec3 >, Sound::MaxVoices > position{}; //3D playback panning control
+		std::array< Sound::Ramp< float >, Sound::MaxVoices > half_volume_radius{};
+
+		//per-mix gains, computed for every voice before any are mixed:
+		std::array< LR, Sound::MaxVoices > gain{};
+		std::array< LR, Sound::MaxVoices > gain_step{};
+	};
+	VoicePool voices;
+
+	//Parameter changes and new samples are sent from the game thread to the audio callback as commands:
+	struct Command {
+		enum Type : uint8_t {
+			Play, //start playing 'data' or 'stream' in 'voice', taking it over if it is still playing
+			SetVolume, //ramp 'voice' volume to 'value' over 'ramp'
+			SetPan, //ramp 'voice' pan to 'value' over 'ramp'
+			SetPosition, //ramp 'voice' position to 'vector' over 'ramp'
+			SetHalfVolumeRadius, //ramp 'voice' half volume radius to 'value' over 'ramp'
+			Stop, //fade out 'voice' over 'ramp'
+			StopAll, //fade out all playing voices over 'ramp'
+			SetGlobalVolume, //ramp global volume to 'value' over 'ramp'
+			SetListener, //ramp listener position to 'vector' and right to 'vector2' over 'ramp'
+		} type;
+		uint32_t voice = -1U; //voice (and generation) the command applies to
+		uint32_t generation = 0;
+		float value = 0.0f;
+		float value2 = 0.0f;
+		glm::vec3 vector = glm::vec3(0.0f);
+		glm::vec3 vector2 = glm::vec3(0.0f);
+		float ramp = 0.0f;
+		//Play only:
+		std::vector< float > const *data = nullptr;
+		std::shared_ptr< OpusStream > stream;
+		bool is_3D = false;
+		bool loop = false;
+	};
+
+	//Lock-free single-producer (game thread), single-consumer (audio callback) ring of commands:
+	struct CommandRing {
+		static constexpr uint32_t Capacity = 4096; //must be a power of two
+
+		std::array< Command, Capacity > commands;
+		std::atomic< uint32_t > head = 0; //next command to read; written only by the consumer
+		std::atomic< uint32_t > tail = 0; //next slot to write; written only by the producer
+
+		bool push(Command &&command) {
+			uint32_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == Capacity) return false; //full
+			commands[t % Capacity] = std::move(command);
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(Command *command) {
+			uint32_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) return false; //empty
+			*command = std::move(commands[h % Capacity]);
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+	};
+	CommandRing command_ring;
+
+	//counters for Sound::queue_stats():
+	Sound::QueueStats queue_stats; //only used by the game thread ('applied' is counted below)
+	std::atomic< uint64_t > commands_applied = 0;
+
+	//Streamed samples are decoded ahead of the audio callback by a background thread:
+	// (started when the first streamed sample plays)
+	std::thread decode_thread;
+	std::mutex decode_mutex; //protects decode_streams and decode_quit
+	std::condition_variable decode_cv;
+	std::vector< std::shared_ptr< OpusStream > > decode_streams;
+	bool decode_quit = false;
 
 }
 
@@ -35,6 +157,103 @@ Sound::Listener Sound::listener;
 //This audio-mixing callback is defined below:
 void mix_audio(void *, SDL_AudioStream *stream, int additional_amount, int total_amount);
 
+//...as is the function that picks the mixing code it uses:
+void choose_mix_kernel();
+
+//...and the function that applies queued commands:
+void apply_commands();
+
+//...and the function that mixes audio for it (or for mix_headless()):
+void mix(LR *buffer, uint32_t samples);
+
+//...and the function that starts decoding a streamed sample:
+std::shared_ptr< OpusStream > start_stream(std::string const &filename, bool loop);
+
+//send a command to the audio callback without blocking (unless the queue is full):
+void send(Command &&command) {
+	queue_stats.sent += 1;
+	if (!command_ring.push(std::move(command))) {
+		//queue is full, so apply queued commands here while the callback isn't running:
+		// (this is the only time the game thread acts as the consumer)
+		auto before = std::chrono::steady_clock::now();
+		Sound::lock();
+		apply_commands();
+		Sound::unlock();
+		bool pushed = command_ring.push(std::move(command));
+		assert(pushed && "queue has room after being drained");
+
+		double blocked = std::chrono::duration< double >(std::chrono::steady_clock::now() - before).count();
+		queue_stats.full += 1;
+		queue_stats.blocked_seconds += blocked;
+		queue_stats.max_blocked_seconds = std::max(queue_stats.max_blocked_seconds, blocked);
+	}
+	//without an audio device, no callback will ever drain the queue:
+	if (stream == nullptr && !headless) {
+		apply_commands();
+	}
+}
+
+//find a voice for a new sample of the given priority, taking over the quietest one if all are busy:
+// (returns -1U if every voice is playing something more important; sets *generation to the voice's new generation)
+uint32_t claim_voice(int priority, uint32_t *generation) {
+	for (uint32_t attempt = 0; attempt < 2; ++attempt) {
+		//look for a free voice, starting just past the last one claimed:
+		for (uint32_t n = 0; n < Sound::MaxVoices; ++n) {
+			uint32_t v = (voices.next_claim + n) % Sound::MaxVoices;
+			uint32_t state = voices.state[v].load(std::memory_order_acquire);
+			if (state & 1) continue; //busy
+			//only the game thread claims voices, so a free voice stays free:
+			*generation = (state >> 1) + 1;
+			voices.state[v].store((*generation << 1) | 1, std::memory_order_release);
+			voices.next_claim = v + 1;
+			return v;
+		}
+
+		//all busy, so find the quietest voice that isn't more important:
+		uint32_t victim = -1U;
+		for (uint32_t v = 0; v < Sound::MaxVoices; ++v) {
+			if (voices.priority[v] > priority) continue;
+			if (victim == -1U
+			 || voices.priority[v] < voices.priority[victim]
+			 || (voices.priority[v] == voices.priority[victim] && voices.loudness[v].load(std::memory_order_relaxed) < voices.loudness[victim].load(std::memory_order_relaxed))) {
+				victim = v;
+			}
+		}
+		if (victim == -1U) return -1U;
+
+		//take it over, unless the audio callback freed it in the meantime (then look again):
+		uint32_t state = voices.state[victim].load(std::memory_order_acquire);
+		if ((state & 1) && voices.state[victim].compare_exchange_strong(state, (((state >> 1) + 1) << 1) | 1, std::memory_order_acq_rel)) {
+			*generation = (state >> 1) + 1;
+			return victim;
+		}
+	}
+	return -1U;
+}
+
+//claim a voice and send a Play command for it (with the command's playback parameters already filled in):
+Sound::PlayingSample start_sample(Command &&play, Sound::Sample const &sample, int priority) {
+	//open a streamed sample first, since that can fail:
+	if (sample.stream_filename.empty()) {
+		play.data = &sample.data;
+	} else {
+		play.stream = start_stream(sample.stream_filename, play.loop);
+	}
+
+	Sound::PlayingSample handle;
+	handle.is_3D = play.is_3D;
+	handle.voice = claim_voice(priority, &handle.generation);
+	if (handle.voice == -1U) return handle;
+
+	voices.priority[handle.voice] = priority;
+	voices.loudness[handle.voice].store(play.value, std::memory_order_relaxed);
+
+	play.voice = handle.voice;
+	play.generation = handle.generation;
+	send(std::move(play));
+	return handle;
+}
+
 //------------------------ public-facing --------------------------------
 
 Sound::Sample::Sample(std::string const &filename) {
@@ -50,6 +269,14 @@ Sound::Sample::Sample(std::string const &filename) {
 Sound::Sample::Sample(std::vector< float > const &data_) : data(data_) {
 }
 
+Sound::Sample::Sample(std::string const &filename, Streamed) : stream_filename(filename) {
+	if (!(filename.size() >= 5 && filename.substr(filename.size()-5) == ".opus")) {
+		throw std::runtime_error("Sample '" + filename + "' doesn't end in \".opus\" -- only opus files can be streamed.");
+	}
+	//open once now so that missing or broken files are reported at load time:
+	OpusStream check(filename, false);
+}
+
 
 
 void Sound::init() {
@@ -59,6 +286,9 @@ void Sound::init() {
 		return;
 	}
 
+	//pick the fastest mixing code this CPU supports:
+	choose_mix_kernel();
+
 	//Based on the example on https://wiki.libsdl.org/SDL_OpenAudioDevice
 	SDL_AudioSpec spec{ .format=SDL_AUDIO_F32, .channels=2, .freq=AUDIO_RATE };
 	stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, mix_audio, nullptr);
@@ -79,125 +309,258 @@ void Sound::shutdown() {
 		SDL_DestroyAudioStream(stream);
 		stream = nullptr;
 	}
+
+	if (decode_thread.joinable()) {
+		//stop decoding streamed samples:
+		{
+			std::unique_lock< std::mutex > guard(decode_mutex);
+			decode_quit = true;
+		}
+		decode_cv.notify_one();
+		decode_thread.join();
+		decode_streams.clear();
+	}
+
+	headless = false;
 }
 
 
 void Sound::lock() {
 	if (stream) SDL_LockAudioStream(stream);
+	else if (headless) headless_mutex.lock();
 }
 
 void Sound::unlock() {
 	if (stream) SDL_UnlockAudioStream(stream);
+	else if (headless) headless_mutex.unlock();
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play(Sample const &sample, float play_volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, pan, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::QueueStats Sound::queue_stats() {
+	QueueStats stats = ::queue_stats;
+	stats.applied = commands_applied.load(std::memory_order_relaxed);
+	return stats;
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, position, half_volume_radius, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+void Sound::init_headless() {
+	assert(stream == nullptr && "init_headless() is for running without an audio device");
+	choose_mix_kernel();
+	headless = true;
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop(Sample const &sample, float play_volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, pan, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+void Sound::mix_headless(float *out, uint32_t frames) {
+	assert(headless && "call Sound::init_headless() first");
+	std::unique_lock< std::mutex > guard(headless_mutex);
+	mix(reinterpret_cast< LR * >(out), frames);
 }
 
+Sound::PlayingSample Sound::play(Sample const &sample, float play_volume, float pan, int priority) {
+	return start_sample(Command{ .type = Command::Play, .value = play_volume, .value2 = pan }, sample, priority);
+}
 
+Sound::PlayingSample Sound::play_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius, int priority) {
+	return start_sample(Command{ .type = Command::Play, .value = play_volume, .value2 = half_volume_radius, .vector = position, .is_3D = true }, sample, priority);
+}
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, position, half_volume_radius, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::PlayingSample Sound::loop(Sample const &sample, float play_volume, float pan, int priority) {
+	return start_sample(Command{ .type = Command::Play, .value = play_volume, .value2 = pan, .loop = true }, sample, priority);
+}
+
+Sound::PlayingSample Sound::loop_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius, int priority) {
+	return start_sample(Command{ .type = Command::Play, .value = play_volume, .value2 = half_volume_radius, .vector = position, .is_3D = true, .loop = true }, sample, priority);
 }
 
 
 void Sound::stop_all_samples() {
-	lock();
-	for (auto &s : playing_samples) {
-		s->stop();
-	}
-	unlock();
+	send(Command{ .type = Command::StopAll, .ramp = 1.0f / 60.0f });
 }
 
 void Sound::set_volume(float new_volume, float ramp) {
-	lock();
-	volume.set(new_volume, ramp);
-	unlock();
+	send(Command{ .type = Command::SetGlobalVolume, .value = new_volume, .ramp = ramp });
 }
 
 //------------------
 
-void Sound::PlayingSample::set_volume(float new_volume, float ramp) {
-	Sound::lock();
-	if (!stopping) {
-		volume.set(new_volume, ramp);
-	}
-	Sound::unlock();
+void Sound::PlayingSample::set_volume(float new_volume, float ramp) const {
+	if (stopped()) return;
+	send(Command{ .type = Command::SetVolume, .voice = voice, .generation = generation, .value = new_volume, .ramp = ramp });
 }
 
-void Sound::PlayingSample::set_pan(float new_pan, float ramp) {
-	if (!(pan.value == pan.value)) return; //ignore if not in '2D' mode
-	Sound::lock();
-	pan.set(new_pan, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_pan(float new_pan, float ramp) const {
+	if (is_3D || stopped()) return; //ignore if not in '2D' mode
+	send(Command{ .type = Command::SetPan, .voice = voice, .generation = generation, .value = new_pan, .ramp = ramp });
 }
 
-void Sound::PlayingSample::set_position(glm::vec3 const &new_position, float ramp) {
-	if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	position.set(new_position, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_position(glm::vec3 const &new_position, float ramp) const {
+	if (!is_3D || stopped()) return; //ignore if not in '3D' mode
+	send(Command{ .type = Command::SetPosition, .voice = voice, .generation = generation, .vector = new_position, .ramp = ramp });
 }
 
-void Sound::PlayingSample::set_half_volume_radius(float new_radius, float ramp) {
-	if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	half_volume_radius.set(new_radius, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_half_volume_radius(float new_radius, float ramp) const {
+	if (!is_3D || stopped()) return; //ignore if not in '3D' mode
+	send(Command{ .type = Command::SetHalfVolumeRadius, .voice = voice, .generation = generation, .value = new_radius, .ramp = ramp });
 }
 
-void Sound::PlayingSample::stop(float ramp) {
-	Sound::lock();
-	if (!(stopping || stopped)) {
-		stopping = true;
-		volume.target = 0.0f;
-		volume.ramp = ramp;
-	} else {
-		volume.ramp = std::min(volume.ramp, ramp);
-	}
-	Sound::unlock();
+void Sound::PlayingSample::stop(float ramp) const {
+	if (stopped()) return;
+	send(Command{ .type = Command::Stop, .voice = voice, .generation = generation, .ramp = ramp });
+}
+
+bool Sound::PlayingSample::stopped() const {
+	if (voice >= MaxVoices) return true;
+	return voices.state[voice].load(std::memory_order_acquire) != ((generation << 1) | 1);
 }
 
 //------------------
 
 void Sound::Listener::set_position_right(glm::vec3 const &new_position, glm::vec3 const &new_right, float ramp) {
-	Sound::lock();
-	position.set(new_position, ramp);
-	//some extra code to make sure right is always a unit vector:
-	if (new_right == glm::vec3(0.0f)) {
-		right.set(glm::vec3(1.0f, 0.0f, 0.0f), ramp);
+	send(Command{ .type = Command::SetListener, .vector = new_position, .vector2 = new_right, .ramp = ramp });
+}
+
+//------------------------ internals --------------------------------
+
+//Background thread that keeps every streamed sample decoded ahead of the audio callback:
+void decode_streams_loop() {
+	std::vector< std::shared_ptr< OpusStream > > streams;
+	std::unique_lock< std::mutex > guard(decode_mutex);
+	while (!decode_quit) {
+		//decode without holding the lock so play() doesn't wait on it:
+		streams = decode_streams;
+		guard.unlock();
+		for (auto &s : streams) {
+			s->decode_ahead();
+		}
+		streams.clear();
+		guard.lock();
+
+		//forget streams no longer referenced by any playing sample:
+		// (holding on until then means streams are freed here, never on the audio thread)
+		decode_streams.erase(std::remove_if(decode_streams.begin(), decode_streams.end(), [](std::shared_ptr< OpusStream > const &s) {
+			return s.use_count() == 1;
+		}), decode_streams.end());
+
+		//buffers hold over a second of audio, so a short nap is plenty responsive:
+		decode_cv.wait_for(guard, std::chrono::milliseconds(10));
+	}
+}
+
+std::shared_ptr< OpusStream > start_stream(std::string const &filename, bool loop) {
+	auto opus_stream = std::make_shared< OpusStream >(filename, loop);
+	{
+		std::unique_lock< std::mutex > guard(decode_mutex);
+		decode_streams.emplace_back(opus_stream);
+		if (!decode_thread.joinable()) {
+			decode_quit = false;
+			decode_thread = std::thread(decode_streams_loop);
+		}
+	}
+	//get decoding started right away:
+	decode_cv.notify_one();
+	return opus_stream;
+}
+
+
+//helper: fade out a playing voice:
+void stop_voice(uint32_t v, float ramp) {
+	if (!voices.stopping[v]) {
+		voices.stopping[v] = true;
+		voices.volume[v].target = 0.0f;
+		voices.volume[v].ramp = ramp;
 	} else {
-		right.set(glm::normalize(new_right), ramp);
+		voices.volume[v].ramp = std::min(voices.volume[v].ramp, ramp);
 	}
-	Sound::unlock();
 }
 
-//------------------------ internals --------------------------------
+//helper: start playing a sample in a voice (which may still be playing an older sample):
+void start_voice(Command &play) {
+	uint32_t v = play.voice;
+	if (!voices.playing[v]) {
+		voices.playing[v] = true;
+		voices.active[voices.active_count++] = v;
+	}
+	voices.generation[v] = play.generation;
+	voices.data[v] = play.data;
+	voices.stream[v] = std::move(play.stream);
+	voices.i[v] = 0;
+	voices.is_3D[v] = play.is_3D;
+	voices.loop[v] = play.loop;
+	voices.stopping[v] = false;
+	voices.volume[v] = Sound::Ramp< float >(play.value);
+	if (play.is_3D) {
+		voices.position[v] = Sound::Ramp< glm::vec3 >(play.vector);
+		voices.half_volume_radius[v] = Sound::Ramp< float >(play.value2);
+	} else {
+		voices.pan[v] = Sound::Ramp< float >(play.value2);
+	}
+}
 
+//helper: stop playing the voice at position 'a' of the active list, and free it for reuse:
+void end_voice(uint32_t a) {
+	uint32_t v = voices.active[a];
+	voices.active[a] = voices.active[--voices.active_count];
+	voices.playing[v] = false;
+	voices.data[v] = nullptr;
+	//(the decoding thread holds on to streams until here, so this won't free them on the audio thread)
+	voices.stream[v].reset();
+
+	//free the voice, unless the game thread has already claimed it again:
+	uint32_t state = (voices.generation[v] << 1) | 1;
+	voices.state[v].compare_exchange_strong(state, voices.generation[v] << 1, std::memory_order_acq_rel);
+}
+
+//Apply all commands sent by the game thread:
+// (called at the start of each mix, or with the audio stream locked)
+void apply_commands() {
+	Command command;
+	uint64_t applied = 0;
+	while (command_ring.pop(&command)) {
+		applied += 1;
+		//commands for a voice that has since moved on to another sample are ignored:
+		uint32_t v = command.voice;
+		bool current = v < Sound::MaxVoices && voices.playing[v] && voices.generation[v] == command.generation;
+		switch (command.type) {
+			case Command::Play:
+				start_voice(command);
+				break;
+			case Command::SetVolume:
+				if (current && !voices.stopping[v]) {
+					voices.volume[v].set(command.value, command.ramp);
+				}
+				break;
+			case Command::SetPan:
+				if (current) voices.pan[v].set(command.value, command.ramp);
+				break;
+			case Command::SetPosition:
+				if (current) voices.position[v].set(command.vector, command.ramp);
+				break;
+			case Command::SetHalfVolumeRadius:
+				if (current) voices.half_volume_radius[v].set(command.value, command.ramp);
+				break;
+			case Command::Stop:
+				if (current) stop_voice(v, command.ramp);
+				break;
+			case Command::StopAll:
+				for (uint32_t a = 0; a < voices.active_count; ++a) {
+					stop_voice(voices.active[a], command.ramp);
+				}
+				break;
+			case Command::SetGlobalVolume:
+				Sound::volume.set(command.value, command.ramp);
+				break;
+			case Command::SetListener:
+				Sound::listener.position.set(command.vector, command.ramp);
+				//some extra code to make sure right is always a unit vector:
+				if (command.vector2 == glm::vec3(0.0f)) {
+					Sound::listener.right.set(glm::vec3(1.0f, 0.0f, 0.0f), command.ramp);
+				} else {
+					Sound::listener.right.set(glm::normalize(command.vector2), command.ramp);
+				}
+				break;
+		}
+		//release any stream reference here rather than when the ring slot is next reused:
+		command.stream.reset();
+	}
+	commands_applied.fetch_add(applied, std::memory_order_relaxed);
+}
 
 //helper: equal-power panning
 inline void compute_pan_weights(float pan, float *left, float *right) {
@@ -300,24 +663,133 @@ void step_direction_ramp(float step, Sound::Ramp< glm::vec3 > &ramp) {
 }
 
 
+//helper: mixing kernels.
+//Each one adds 'count' mono samples from 'in' into the interleaved stereo 'out' buffer,
+// with per-channel gains starting at 'pan' and changing by 'pan_step' after every sample:
+
+typedef void (*MixKernel)(LR *out, float const *in, uint32_t count, LR pan, LR pan_step);
+
+void mix_scalar(LR *out, float const *in, uint32_t count, LR pan, LR pan_step) {
+	for (uint32_t i = 0; i < count; ++i) {
+		out[i].l += (pan.l + i * pan_step.l) * in[i];
+		out[i].r += (pan.r + i * pan_step.r) * in[i];
+	}
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SOUND_MIX_X86 1
+
+//SSE: four stereo frames (two registers) per iteration:
+void mix_sse(LR *out, float const *in, uint32_t count, LR pan, LR pan_step) {
+	//gains for frames 0,1 and 2,3 as (l, r, l, r):
+	__m128 pan_a = _mm_setr_ps(pan.l, pan.r, pan.l + pan_step.l, pan.r + pan_step.r);
+	__m128 pan_b = _mm_add_ps(pan_a, _mm_setr_ps(2.0f * pan_step.l, 2.0f * pan_step.r, 2.0f * pan_step.l, 2.0f * pan_step.r));
+	__m128 step = _mm_setr_ps(4.0f * pan_step.l, 4.0f * pan_step.r, 4.0f * pan_step.l, 4.0f * pan_step.r);
+
+	float *dst = reinterpret_cast< float * >(out);
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(in + i);
+		__m128 x_a = _mm_unpacklo_ps(x, x); //(x0, x0, x1, x1)
+		__m128 x_b = _mm_unpackhi_ps(x, x); //(x2, x2, x3, x3)
+		_mm_storeu_ps(dst + 2 * i, _mm_add_ps(_mm_loadu_ps(dst + 2 * i), _mm_mul_ps(pan_a, x_a)));
+		_mm_storeu_ps(dst + 2 * i + 4, _mm_add_ps(_mm_loadu_ps(dst + 2 * i + 4), _mm_mul_ps(pan_b, x_b)));
+		pan_a = _mm_add_ps(pan_a, step);
+		pan_b = _mm_add_ps(pan_b, step);
+	}
+
+	//leftover frames:
+	mix_scalar(out + i, in + i, count - i, LR{ pan.l + i * pan_step.l, pan.r + i * pan_step.r }, pan_step);
+}
+
+//AVX2: eight stereo frames (two registers) per iteration:
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+void mix_avx2(LR *out, float const *in, uint32_t count, LR pan, LR pan_step) {
+	//gains for frames 0-3 and 4-7 as (l, r, l, r, ...):
+	__m256 pan_a = _mm256_setr_ps(
+		pan.l, pan.r,
+		pan.l + pan_step.l, pan.r + pan_step.r,
+		pan.l + 2.0f * pan_step.l, pan.r + 2.0f * pan_step.r,
+		pan.l + 3.0f * pan_step.l, pan.r + 3.0f * pan_step.r
+	);
+	__m256 half_step = _mm256_setr_ps(
+		4.0f * pan_step.l, 4.0f * pan_step.r, 4.0f * pan_step.l, 4.0f * pan_step.r,
+		4.0f * pan_step.l, 4.0f * pan_step.r, 4.0f * pan_step.l, 4.0f * pan_step.r
+	);
+	__m256 pan_b = _mm256_add_ps(pan_a, half_step);
+	__m256 step = _mm256_add_ps(half_step, half_step);
+
+	__m256i spread_a = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	__m256i spread_b = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+
+	float *dst = reinterpret_cast< float * >(out);
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(in + i);
+		__m256 x_a = _mm256_permutevar8x32_ps(x, spread_a); //(x0, x0, ..., x3, x3)
+		__m256 x_b = _mm256_permutevar8x32_ps(x, spread_b); //(x4, x4, ..., x7, x7)
+		_mm256_storeu_ps(dst + 2 * i, _mm256_add_ps(_mm256_loadu_ps(dst + 2 * i), _mm256_mul_ps(pan_a, x_a)));
+		_mm256_storeu_ps(dst + 2 * i + 8, _mm256_add_ps(_mm256_loadu_ps(dst + 2 * i + 8), _mm256_mul_ps(pan_b, x_b)));
+		pan_a = _mm256_add_ps(pan_a, step);
+		pan_b = _mm256_add_ps(pan_b, step);
+	}
+
+	//leftover frames:
+	mix_scalar(out + i, in + i, count - i, LR{ pan.l + i * pan_step.l, pan.r + i * pan_step.r }, pan_step);
+}
+
+bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6); //OSXSAVE + XMM/YMM state enabled
+	__cpuidex(info, 7, 0);
+	return os_saves_ymm && (info[1] & (1 << 5));
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif //x86-64
+
+//chosen in Sound::init() based on what the CPU supports:
+MixKernel mix_kernel = mix_scalar;
+
+void choose_mix_kernel() {
+#ifdef SOUND_MIX_X86
+	if (cpu_has_avx2()) {
+		mix_kernel = mix_avx2;
+	} else {
+		mix_kernel = mix_sse;
+	}
+#endif
+}
+
+
 //The audio callback -- invoked by SDL when it needs more sound to play:
 void SDLCALL mix_audio(void *, SDL_AudioStream *stream_, int additional_amount, int total_amount) {
 	if (total_amount <= 0) return;
 	assert(stream_ == stream && "callback should only be used with our main stream");
 
-	struct LR {
-		float l;
-		float r;
-	};
-	static_assert(sizeof(LR) == 8, "Sample is packed");
-
 	uint32_t samples = uint32_t(total_amount) / sizeof(LR);
 
 	//adapted from older code using https://github.com/libsdl-org/SDL/blob/main/docs/README-migration.md
 	int len = samples * sizeof(LR);
 	Uint8 *buffer_ = SDL_stack_alloc(Uint8, len); //this is not actually responsive to the amount of samples requested, it just mixes in blocks of MIX_SAMPLES
 
-	LR *buffer = reinterpret_cast< LR * >(buffer_);
+	mix(reinterpret_cast< LR * >(buffer_), samples);
+
+	SDL_PutAudioStreamData(stream, buffer_, len);
+	SDL_stack_free(buffer_);
+}
+
+void mix(LR *buffer, uint32_t samples) {
+	//pick up parameter changes and new samples from the game thread:
+	apply_commands();
 
 	//zero the output buffer:
 	for (uint32_t s = 0; s < samples; ++s) {
@@ -340,87 +812,115 @@ void SDLCALL mix_audio(void *, SDL_AudioStream *stream_, int additional_amount,
 	glm::vec3 end_position =  Sound::listener.position.value;
 	glm::vec3 end_right =  Sound::listener.right.value;
 
-	//add audio from each playing sample into the buffer:
-	for (auto si = playing_samples.begin(); si != playing_samples.end(); /* later */) {
-		Sound::PlayingSample &playing_sample = **si; //much more convenient than writing ** everywhere.
+	//update the parameters of every playing voice, working out its gains over this mix period:
+	for (uint32_t a = 0; a < voices.active_count; ++a) {
+		uint32_t v = voices.active[a];
 
 		//Figure out sample panning/volume at start...
 		LR start_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
+		if (voices.is_3D[v]) {
 			//3D panning
 			compute_pan_from_listener_and_position(
 				start_position, start_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
+				voices.position[v].value,
+				voices.half_volume_radius[v].value,
 				&start_pan.l, &start_pan.r);
 
-			step_position_ramp(elapsed, playing_sample.position);
-			step_value_ramp(elapsed, playing_sample.half_volume_radius);
+			step_position_ramp(elapsed, voices.position[v]);
+			step_value_ramp(elapsed, voices.half_volume_radius[v]);
 		} else {
 			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &start_pan.l, &start_pan.r);
+			compute_pan_weights(voices.pan[v].value, &start_pan.l, &start_pan.r);
 
-			step_value_ramp(elapsed, playing_sample.pan);
+			step_value_ramp(elapsed, voices.pan[v]);
 		}
-		start_pan.l *= start_volume * playing_sample.volume.value;
-		start_pan.r *= start_volume * playing_sample.volume.value;
+		start_pan.l *= start_volume * voices.volume[v].value;
+		start_pan.r *= start_volume * voices.volume[v].value;
 
-		step_value_ramp(elapsed, playing_sample.volume);
+		step_value_ramp(elapsed, voices.volume[v]);
 
 		//..and end of the mix period:
 		LR end_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
+		if (voices.is_3D[v]) {
 			//3D panning
 			compute_pan_from_listener_and_position(
 				end_position, end_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
+				voices.position[v].value,
+				voices.half_volume_radius[v].value,
 				&end_pan.l, &end_pan.r);
 		} else {
 			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &end_pan.l, &end_pan.r);
+			compute_pan_weights(voices.pan[v].value, &end_pan.l, &end_pan.r);
 		}
 
-		end_pan.l *= end_volume * playing_sample.volume.value;
-		end_pan.r *= end_volume * playing_sample.volume.value;
+		end_pan.l *= end_volume * voices.volume[v].value;
+		end_pan.r *= end_volume * voices.volume[v].value;
 
 		//figure out a step to add at each sample so that pan will move smoothly from start to end:
-		LR pan = start_pan;
-		LR pan_step;
-		pan_step.l = (end_pan.l - start_pan.l) / samples;
-		pan_step.r = (end_pan.r - start_pan.r) / samples;
-
-		assert(playing_sample.i < playing_sample.data.size());
-
-		for (uint32_t i = 0; i < samples; ++i) {
-			//mix one sample based on current pan values:
-			buffer[i].l += pan.l * playing_sample.data[playing_sample.i];
-			buffer[i].r += pan.r * playing_sample.data[playing_sample.i];
-
-			//update position in sample:
-			playing_sample.i += 1;
-			if (playing_sample.i == playing_sample.data.size()) {
-				if (playing_sample.loop) {
-					playing_sample.i = 0;
-				} else {
-					break;
+		voices.gain[v] = start_pan;
+		voices.gain_step[v].l = (end_pan.l - start_pan.l) / samples;
+		voices.gain_step[v].r = (end_pan.r - start_pan.r) / samples;
+
+		//let the game thread know how loud this voice is, in case it needs to take over a voice:
+		voices.loudness[v].store(std::max(end_pan.l, end_pan.r), std::memory_order_relaxed);
+	}
+
+	//add audio from each playing voice into the buffer:
+	for (uint32_t a = 0; a < voices.active_count; /* later */) {
+		uint32_t v = voices.active[a];
+		LR pan = voices.gain[v];
+		LR pan_step = voices.gain_step[v];
+
+		bool finished;
+		if (voices.stream[v]) {
+			//streamed sample: mix whatever has been decoded so far, in contiguous runs of its ring buffer:
+			// (if decoding falls behind this leaves a gap rather than waiting)
+			OpusStream &opus_stream = *voices.stream[v];
+			for (uint32_t mixed = 0; mixed < samples; /* later */) {
+				std::span< float const > run = opus_stream.peek(samples - mixed);
+				if (run.empty()) break;
+				mix_kernel(buffer + mixed, run.data(), uint32_t(run.size()), pan, pan_step);
+
+				//update pan values and position in stream:
+				pan.l += run.size() * pan_step.l;
+				pan.r += run.size() * pan_step.r;
+				opus_stream.consume(uint32_t(run.size()));
+				mixed += uint32_t(run.size());
+			}
+			finished = opus_stream.finished();
+		} else {
+			std::vector< float > const &data = *voices.data[v];
+			uint32_t &i = voices.i[v];
+			assert(i < data.size());
+
+			//mix contiguous runs of the sample, up to its end (where it either loops or stops):
+			for (uint32_t mixed = 0; mixed < samples; /* later */) {
+				uint32_t run = std::min(samples - mixed, uint32_t(data.size() - i));
+				mix_kernel(buffer + mixed, data.data() + i, run, pan, pan_step);
+
+				//update pan values and position in sample:
+				pan.l += run * pan_step.l;
+				pan.r += run * pan_step.r;
+				i += run;
+				mixed += run;
+
+				if (i == data.size()) {
+					if (voices.loop[v]) {
+						i = 0;
+					} else {
+						break;
+					}
 				}
 			}
-
-			//update pan values:
-			pan.l += pan_step.l;
-			pan.r += pan_step.r;
+			finished = (i >= data.size());
 		}
 
-		if (playing_sample.i >= playing_sample.data.size()
-		 || (playing_sample.stopping && playing_sample.volume.value == 0.0f)) { //sample has finished
-		 	playing_sample.stopped = true;
-			//erase from list:
-			auto old = si;
-			++si;
-			playing_samples.erase(old);
+		if (finished
+		 || (voices.stopping[v] && voices.volume[v].value == 0.0f)) { //sample has finished
+			//(this moves the last active voice to position 'a', so don't advance)
+			end_voice(a);
 		} else {
-			++si;
+			++a;
 		}
 	}
 
@@ -429,11 +929,8 @@ void SDLCALL mix_audio(void *, SDL_AudioStream *stream_, int additional_amount,
 	for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
 		max_power = std::max(max_power, (buffer[s].l * buffer[s].l + buffer[s].r * buffer[s].r));
 	}
-	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing samples: " << playing_samples.size() << std::endl; //DEBUG
+	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing voices: " << voices.active_count << std::endl; //DEBUG
 	*/
-
-	SDL_PutAudioStreamData(stream, buffer_, len);
-	SDL_stack_free(buffer_);
 }
 
 
@@ -2,10 +2,11 @@
 
 #include <glm/glm.hpp>
 
-#include <memory>
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 
 //Game audio system. Simplified from f18-base3.
 //Uses 48kHz sampling rate.
@@ -21,8 +22,16 @@ struct Sample {
 	//Directly supply an audio buffer:
 	Sample(std::vector< float > const &data);
 
+	//Stream an '.opus' file as it plays instead of decoding it all up front:
+	//  (good for long music tracks; each playback decodes ahead on a background thread)
+	struct Streamed { };
+	Sample(std::string const &filename, Streamed);
+
 	//sample data is stored as 48kHz, mono, floating-point:
 	std::vector< float > data;
+
+	//...unless the sample is streamed, in which case 'data' is empty and this is the file to play:
+	std::string stream_filename;
 };
 
 //Ramp<> manages values that should be smoothly interpolated
@@ -48,43 +57,33 @@ struct Ramp {
 	float ramp = 0.0f;
 };
 
-// 'PlayingSample' objects book-keep samples that are currently playing:
+//Samples play in a fixed pool of voices (no allocation when starting a sample):
+constexpr uint32_t MaxVoices = 64;
+
+// 'PlayingSample' is a handle to a sample started by one of the play functions below.
+//  it is small and copyable; once the sample stops -- or its voice is taken over by a newer sample -- its functions do nothing.
 struct PlayingSample {
-	//change the panning or volume of a playing sample (and do proper locking);
-	// value will change over 'ramp' seconds to avoid creating audible artifacts:
-	void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
+	//change the panning or volume of a playing sample;
+	// value will change over 'ramp' seconds to avoid creating audible artifacts.
+	// (these functions queue the change for the audio thread without locking; call them from a single thread)
+	void set_volume(float new_volume, float ramp = 1.0f / 60.0f) const;
 	//set the panning of a sample (use only on samples in "2D" mode; no effect on "3D" samples):
-	void set_pan(float new_pan, float ramp = 1.0f / 60.0f);
+	void set_pan(float new_pan, float ramp = 1.0f / 60.0f) const;
 	//set the position of a sample (use only on samples in "3D" mode; no effect on "2D" samples):
-	void set_position(glm::vec3 const &new_position, float ramp = 1.0f / 60.0f);
+	void set_position(glm::vec3 const &new_position, float ramp = 1.0f / 60.0f) const;
 	//set the half-volume radius (use only on "3D" playing sounds):
-	void set_half_volume_radius(float new_radius, float ramp = 1.0f / 60.0f);
+	void set_half_volume_radius(float new_radius, float ramp = 1.0f / 60.0f) const;
 
 	//'stop' will fade sample out over 'ramp' seconds and then remove it from the active samples:
-	void stop(float ramp = 1.0f / 60.0f);
+	void stop(float ramp = 1.0f / 60.0f) const;
+
+	//has playback finished (either by running out of sample, by stop(), or by losing its voice)?
+	bool stopped() const;
 
 	//internals:
-	//NOTE: PlayingSample is used in a separate thread; so setting these values directly
-	// may result in bad results. Instead, use the functions above, which perform locking!
-	std::vector< float > const &data; //reference to sample data being played
-	uint32_t i = 0; //next data value to read
-	bool loop = false; //should playback loop after data runs out?
-	bool stopping = false; //is playing stopping?
-	bool stopped = false; //was playback stopped (either by running out of sample, or by stop())?
-
-	Ramp< float > volume = Ramp< float >(1.0f);
-
-	//2D playback panning control: ('NaN' if sound played in 3D mode)
-	Ramp< float > pan = Ramp< float >(std::numeric_limits< float >::quiet_NaN());
-
-	//3D playback panning control: ('NaN' if sound played in 2D mode)
-	Ramp< glm::vec3 > position = Ramp< glm::vec3 >(std::numeric_limits< float >::quiet_NaN());
-	Ramp< float > half_volume_radius = std::numeric_limits< float >::quiet_NaN();
-
-	PlayingSample(Sample const &sample_, float volume_, float pan_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), pan(pan_) { }
-	PlayingSample(Sample const &sample_, float volume_, glm::vec3 const &position_, float half_volume_radius_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), position(position_), half_volume_radius(half_volume_radius_) { }
+	uint32_t voice = -1U; //slot in the voice pool (-1U if the sample never got a voice)
+	uint32_t generation = 0; //which use of that slot this handle refers to
+	bool is_3D = false; //was sample played in "3D" mode?
 };
 
 // ------- global functions -------
@@ -95,32 +94,38 @@ void shutdown(); //call Sound::shutdown() from main.cpp to gracefully(-ish) exit
 
 //Call 'Sound::play' to play a sample once.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback early.
-std::shared_ptr< PlayingSample > play(
+//  when all voices are busy, the sample takes over the quietest voice of equal or lower 'priority'
+//  (if there is none, it doesn't play and the returned handle is already stopped)
+PlayingSample play(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	int priority = 0
 );
 //The play_3D version will play a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > play_3D(
+PlayingSample play_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	int priority = 0
 );
 
 //Call 'Sound::loop' to play a sample ~forever~.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback.
-std::shared_ptr< PlayingSample > loop(
+PlayingSample loop(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	int priority = 0
 );
 //The loop_3D version will loop a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > loop_3D(
+PlayingSample loop_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	int priority = 0
 );
 
 //Listener controls the panning of "3D" samples (ones played using the "position" version of the play functions):
@@ -140,9 +145,26 @@ void stop_all_samples();
 void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
 extern Ramp< float > volume;
 
+//Counters for the command queue that carries the functions above to the audio callback:
+struct QueueStats {
+	uint64_t sent = 0; //commands sent by the game thread
+	uint64_t applied = 0; //commands applied (by the audio callback, or by the game thread when the queue was full)
+	uint64_t full = 0; //times a command found the queue full
+	double blocked_seconds = 0.0; //time the game thread spent waiting for room in the queue...
+	double max_blocked_seconds = 0.0; //...and the longest single wait
+};
+QueueStats queue_stats(); //call from the game thread
+
+//Running without an audio device (for tools such as sound-stress):
+// after init_headless(), commands wait in the queue until mix_headless() is called, which
+// plays the part of the audio callback (call it from one thread, which may not be the game thread)
+void init_headless();
+//apply queued commands and mix 'frames' stereo frames into 'out' (2 * frames floats, left then right):
+void mix_headless(float *out, uint32_t frames);
+
 //the audio callback doesn't run between Sound::lock() and Sound::unlock()
-// the set_*/stop/play/... functions already use these helpers, so you shouldn't need
-// to call them unless your code is modifying values directly:
+// the set_*/stop/play/... functions send their changes through a lock-free queue instead,
+// so you shouldn't need to call these unless your code is modifying values directly:
 void lock();
 void unlock();
 
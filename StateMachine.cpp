@@ -2,395 +2,454 @@
 
 #include <assert.h>
 #include <iostream>
-#include <sstream>
 #include <algorithm>
 
-#include "gl_compile_program.hpp"
-
-// Shaders taken from https://github.com/jialand/TheMuteLift#
-const GLchar *vertexSrc =
-    R"GLSL(
-        #version 330
-        layout(location=0) in vec2 aPos;
-        layout(location=1) in vec2 aUV;
-        out vec2 vUV;
-        uniform vec2 uScreen; // in pixels
-        void main(){
-            vUV = aUV;
-            // pixel -> NDC. Note: NDC y goes up; here (0,0) = top-left corner
-            float x = (aPos.x / uScreen.x) * 2.0 - 1.0;
-            float y = 1.0 - (aPos.y / uScreen.y) * 2.0;
-            gl_Position = vec4(x, y, 0.0, 1.0);
-        }
-    )GLSL";
-
-const GLchar *fragmentSrc =
-    R"GLSL(
-        #version 330
-        in vec2 vUV;
-        out vec4 FragColor;
-        uniform sampler2D uTex; // R8, red channel as alpha
-        uniform vec3 uColor;
-        void main(){
-            float a = texture(uTex, vUV).r;
-            FragColor = vec4(uColor, a);
-        }
-    )GLSL";
+#include "read_write_chunk.hpp"
 
-TextManager::TextManager()
+StateMachine::StateMachine()
 {
-    FT_Error ft_error;
-
-    if ((ft_error = FT_Init_FreeType(&ft_library)))
-    {
-        std::cout << "No library" << std::endl;
-        abort();
-    }
-    if ((ft_error = FT_New_Face(ft_library, font_file, 0, &ft_face)))
-    {
-        std::cout << "No Face " << ft_error << std::endl;
-        abort();
-    }
-    if ((ft_error = FT_Set_Char_Size(ft_face, font_size * 64, font_size * 64, 0, 0)))
-    {
-        std::cout << "No Char size" << std::endl;
-        abort();
-    }
+    story = std::make_shared<Story>();
+}
 
-    hb_font = hb_ft_font_create(ft_face, NULL);
-    hb_ft_font_set_funcs(hb_font); // use FT-provided metric functions
-
-    // Taken from https://github.com/jialand/TheMuteLift#
-    program = gl_compile_program(vertexSrc, fragmentSrc);
-    Position = glGetUniformLocation(program, "uScreen");
-    Colour = glGetUniformLocation(program, "uColor");
-    TexCoord = glGetUniformLocation(program, "uTex");
-
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)0);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)(sizeof(float) * 2));
-    glBindVertexArray(0);
+StateMachine::StateMachine(std::vector<State> _states, std::vector<Transition> _transitions)
+{
+    story = std::make_shared<Story>();
+    story->states = std::move(_states);
+    story->transitions = std::move(_transitions);
+    assert(story->states.size() != 0 && "Cannot pass an empty state vector to the constructor");
+    story->hashes = hash_states(story->states, story->transitions);
+    reserve_text();
+    reset();
 }
 
-TextManager::~TextManager()
+StateMachine::StateMachine(const StateMachine &other)
 {
-    for (auto &ch : character_atlas)
-    {
-        if (ch.second.tex_id)
-            glDeleteTextures(1, &ch.second.tex_id);
-    }
-    hb_font_destroy(hb_font);
-    FT_Done_Face(ft_face);
-    FT_Done_FreeType(ft_library);
-    glDeleteBuffers(1, &vbo);
-    glDeleteVertexArrays(1, &vao);
-    glDeleteProgram(program);
+    *this = other;
 }
 
-void TextManager::load_glyph(hb_codepoint_t gid)
+StateMachine &StateMachine::operator=(const StateMachine &other)
 {
-    FT_Load_Glyph(ft_face, gid, FT_LOAD_DEFAULT);
-
-    FT_GlyphSlot slot = ft_face->glyph;
-    FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL);
-
-    FT_Bitmap bitmap = slot->bitmap;
-
-    Glyph g;
-    g.width = bitmap.width;
-    g.height = bitmap.rows;
-    g.bearing_x = slot->bitmap_left;
-    g.bearing_y = slot->bitmap_top;
-    g.advance = slot->advance.x / 64.0f;
-
-    // Texture loading taken from https://github.com/jialand/TheMuteLift#
-    glGenTextures(1, &g.tex_id);
-    glBindTexture(GL_TEXTURE_2D, g.tex_id);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, g.width, g.height, 0, GL_RED, GL_UNSIGNED_BYTE, bitmap.buffer);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    character_atlas.emplace(std::pair(gid, g));
+    if (this == &other)
+        return *this;
+
+    story = other.story;
+    current = other.current;
+    // The copy gets the same room as the original, so switching states still doesn't allocate
+    text_to_display.reserve(story->longest_text);
+    text_to_display.assign(other.text_to_display);
+    shaped_runs = other.shaped_runs;
+    shaped_run_count = other.shaped_run_count;
+    return *this;
 }
 
-void TextManager::draw_text(std::string str, glm::vec2 window_dimensions, glm::vec2 anchor, glm::vec3 colour)
+void StateMachine::load(const std::string &filename)
 {
-    glUseProgram(program);
-    glUniform2f(Position, float(window_dimensions.x), float(window_dimensions.y));
-    glActiveTexture(GL_TEXTURE0);
-    glUniform1i(TexCoord, 0);
+    read_story(filename);
+    reserve_text();
+    reset();
+}
 
-    // Position of the cursor that is writing the text
-    float pen_x = anchor.x;
-    float pen_y = anchor.y;
+uint32_t StateMachine::reload(const std::string &filename)
+{
+    // Keep the old story alive until done comparing (the old hashes are still needed)
+    std::shared_ptr<const Story> old_story = story;
+    const std::vector<uint64_t> &old_hashes = old_story->hashes;
+    read_story(filename);
+    reserve_text();
 
-    std::vector<std::string> wrapped_text = wrap_text(str, window_dimensions, anchor);
-    for (std::string line : wrapped_text)
-    {
-        hb_buffer_t *hb_buffer;
-        hb_buffer = hb_buffer_create();
-        hb_buffer_add_utf8(hb_buffer, line.c_str(), -1, 0, -1);
-        hb_buffer_guess_segment_properties(hb_buffer);
-
-        hb_feature_t features[] = {
-            {HB_TAG('k', 'e', 'r', 'n'), 1, 0, ~0u},
-            {HB_TAG('l', 'i', 'g', 'a'), 1, 0, ~0u},
-        };
+    const std::vector<uint64_t> &hashes = story->hashes;
+    const std::vector<State> &states = story->states;
 
-        hb_shape(hb_font, hb_buffer, features, sizeof(features) / sizeof(features[0]));
+    uint32_t changed = count_changed_states(old_hashes, hashes);
 
-        unsigned int len = hb_buffer_get_length(hb_buffer);
-        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, NULL);
-        hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(hb_buffer, NULL);
+    // Follow the current state by its content hash rather than its index, since adding or removing
+    // a state before it moves it (if several states have that hash, take the one nearest its old index)
+    uint32_t moved_to = -1U;
+    if (current < old_hashes.size())
+    {
+        for (uint32_t i = 0; i < hashes.size(); i++)
+        {
+            if (hashes[i] != old_hashes[current])
+                continue;
+            auto distance = [this](uint32_t index) { return index > current ? index - current : current - index; };
+            if (moved_to == -1U || distance(i) < distance(moved_to))
+                moved_to = i;
+        }
+    }
 
-        glUniform3f(Colour, colour.r, colour.g, colour.b);
-        glBindVertexArray(vao);
+    if (moved_to != -1U)
+    {
+        // The displayed text is unchanged (and has its own copy), so it stays as is,
+        // but the glyphs of the transition that led here aren't known anymore
+        current = moved_to;
+        shaped_run_count = 0;
+    }
+    else if (current < states.size())
+    {
+        // The state itself was edited, so it is found by its id instead
+        text_to_display.assign(states[current].text);
+        update_shaped_runs(-1U);
+    }
+    else
+    {
+        reset();
+    }
 
-        // Enable alpha blending for text rendering
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    return changed;
+}
 
-        for (unsigned int i = 0; i < len; i++)
+std::vector<uint64_t> StateMachine::hash_states(std::span<const State> states, std::span<const Transition> transitions)
+{
+    // FNV-1a, with lengths mixed in so that moving text between fields changes the hash
+    uint64_t hash = 0;
+    auto mix = [&hash](const void *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
         {
-            hb_codepoint_t gid = info[i].codepoint;
-
-            if (gid == 0)
-            {
-                throw std::invalid_argument("File contained characters not defined in the given font");
-            }
-
-            // Get the current glyph
-            const auto &found = character_atlas.find(gid);
-            Glyph glyph;
-            if (found == character_atlas.end())
-            {
-                load_glyph(gid);
-            }
-            glyph = character_atlas[gid];
-
-            // Adapted from https://github.com/tangrams/harfbuzz-example
-            float x_advance = pos[i].x_advance / 64.0f;
-            float y_advance = pos[i].y_advance / 64.0f;
-            float x_offset = pos[i].x_offset / 64.0f;
-            float y_offset = pos[i].y_offset / 64.0f;
-
-            float x0 = pen_x + x_offset + glyph.bearing_x;
-            float y0 = pen_y - y_offset - glyph.bearing_y;
-            float x1 = x0 + glyph.width;
-            float y1 = y0 + glyph.height;
-
-            float quad[] = {
-                x0, y0, 0.0f, 0.0f,
-                x1, y0, 1.0f, 0.0f,
-                x1, y1, 1.0f, 1.0f,
-
-                x0, y0, 0.0f, 0.0f,
-                x1, y1, 1.0f, 1.0f,
-                x0, y1, 0.0f, 1.0f};
-
-            glBindTexture(GL_TEXTURE_2D, glyph.tex_id);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_DYNAMIC_DRAW);
-            glDrawArrays(GL_TRIANGLES, 0, 6);
-
-            pen_x += x_advance;
-            pen_y += y_advance;
+            hash ^= ((const uint8_t *)data)[i];
+            hash *= 0x100000001b3ull;
         }
+    };
+    auto mix_text = [&mix](std::string_view str)
+    {
+        uint64_t size = str.size();
+        mix(&size, sizeof(size));
+        mix(str.data(), str.size());
+    };
+    auto transitions_of = [&transitions](const State &state)
+    {
+        return transitions.subspan(state.transition_begin, state.transition_count);
+    };
 
-        pen_x = anchor.x;
-        pen_y += font_size;
+    // The content of each state on its own, which doesn't depend on any id
+    std::vector<uint64_t> contents;
+    contents.reserve(states.size());
+    for (const State &state : states)
+    {
+        hash = 0xcbf29ce484222325ull;
+        mix_text(state.text);
+        for (const Transition &transition : transitions_of(state))
+        {
+            uint8_t leads_somewhere = (transition.dst_id != -1U);
+            mix(&leads_somewhere, sizeof(leads_somewhere));
+            mix_text(transition.text);
+        }
+        contents.emplace_back(hash);
+    }
 
-        hb_buffer_destroy(hb_buffer);
-        glBindVertexArray(0);
+    // Then where the transitions lead, by the content of their destinations
+    std::vector<uint64_t> hashes;
+    hashes.reserve(states.size());
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        hash = contents[i];
+        for (const Transition &transition : transitions_of(states[i]))
+        {
+            // (a state added later by add_state may not exist yet)
+            uint64_t destination = (transition.dst_id == -1U ? 0 : transition.dst_id < states.size() ? contents[transition.dst_id] : 1);
+            mix(&destination, sizeof(destination));
+        }
+        hashes.emplace_back(hash);
     }
+    return hashes;
+}
 
-    glDisable(GL_BLEND);
-    glUseProgram(0);
+uint32_t StateMachine::count_changed_states(std::span<const uint64_t> old_hashes, std::span<const uint64_t> new_hashes)
+{
+    // Pair up equal hashes between the two builds, wherever the states are
+    // (an edited, added or removed state leaves one hash unpaired on one side)
+    std::vector<uint64_t> old_sorted(old_hashes.begin(), old_hashes.end());
+    std::vector<uint64_t> new_sorted(new_hashes.begin(), new_hashes.end());
+    std::sort(old_sorted.begin(), old_sorted.end());
+    std::sort(new_sorted.begin(), new_sorted.end());
+    size_t unchanged = 0;
+    for (size_t o = 0, n = 0; o < old_sorted.size() && n < new_sorted.size();)
+    {
+        if (old_sorted[o] < new_sorted[n])
+            o++;
+        else if (new_sorted[n] < old_sorted[o])
+            n++;
+        else
+        {
+            unchanged++;
+            o++;
+            n++;
+        }
+    }
+    return uint32_t(std::max(old_sorted.size(), new_sorted.size()) - unchanged);
 }
 
-std::vector<std::string> TextManager::wrap_text(std::string str, glm::vec2 window_dimensions, glm::vec2 anchor)
+void StateMachine::read_story(const std::string &filename)
 {
-    std::stringstream ss(str);
+    auto mapped = std::make_shared<const MappedFile>(filename);
+    ChunkCursor cursor(mapped->bytes());
+
+    std::vector<StateEntry> state_storage;
+    std::span<const StateEntry> state_entries = read_chunk(cursor, "sta0", &state_storage);
 
-    std::vector<std::string> words;
+    std::vector<TransitionEntry> transition_storage;
+    std::span<const TransitionEntry> transition_entries = read_chunk(cursor, "trn0", &transition_storage);
 
-    std::string token;
-    while (getline(ss, token, ' '))
-        words.emplace_back(token);
+    std::span<const char> pool = read_chunk<char>(cursor, "str0");
 
-    std::vector<std::string> output;
-    std::string line;
-    float line_length = 0.0f;
-    float acc = 0.0f;
-    for (std::string word : words)
+    if (state_entries.empty())
     {
-        if (word.length() == 0)
-            continue;
+        throw std::runtime_error("Story file '" + filename + "' does not contain any state");
+    }
 
-        hb_buffer_t *hb_buffer;
-        hb_buffer = hb_buffer_create();
-        hb_buffer_add_utf8(hb_buffer, word.c_str(), -1, 0, -1);
-        hb_buffer_guess_segment_properties(hb_buffer);
+    auto view = [&pool](uint32_t begin, uint32_t end) -> std::string_view
+    {
+        if (!(begin <= end && end <= pool.size()))
+        {
+            throw std::runtime_error("Story file contains an entry with invalid text indices");
+        }
+        return std::string_view(pool.data() + begin, end - begin);
+    };
 
-        hb_feature_t features[] = {
-            {HB_TAG('k', 'e', 'r', 'n'), 1, 0, ~0u},
-            {HB_TAG('l', 'i', 'g', 'a'), 1, 0, ~0u},
-        };
+    std::vector<Transition> loaded_transitions;
+    loaded_transitions.reserve(transition_entries.size());
 
-        hb_shape(hb_font, hb_buffer, features, sizeof(features) / sizeof(features[0]));
+    for (const TransitionEntry &transition_entry : transition_entries)
+    {
+        if (transition_entry.dst_id != -1U && transition_entry.dst_id >= state_entries.size())
+        {
+            throw std::runtime_error("Story file contains a transition to unknown state " + std::to_string(transition_entry.dst_id));
+        }
 
-        unsigned int glyph_count_after;
-        unsigned int len = hb_buffer_get_length(hb_buffer);
-        hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(hb_buffer, NULL);
-        hb_glyph_info_t *infos = hb_buffer_get_glyph_infos(hb_buffer, &glyph_count_after);
+        Transition transition;
+        transition.dst_id = transition_entry.dst_id;
+        transition.text = view(transition_entry.text_begin, transition_entry.text_end);
+        loaded_transitions.emplace_back(transition);
+    }
 
-        unsigned int break_index = 0;
+    std::vector<State> loaded_states;
+    loaded_states.reserve(state_entries.size());
 
-        unsigned int token_length = 0;
-        unsigned int string_index = 0;
-        unsigned int break_string_index = 0;
+    for (const StateEntry &entry : state_entries)
+    {
+        State state;
+        state.id = uint32_t(loaded_states.size());
+        state.text = view(entry.text_begin, entry.text_end);
 
-        bool word_fit = false;
-        bool no_break = true;
-        uint32_t current_cluster = infos[0].cluster;
+        if (!(entry.transition_begin <= entry.transition_end && entry.transition_end <= transition_entries.size()))
+        {
+            throw std::runtime_error("Story file contains state " + std::to_string(state.id) + " with invalid transition indices");
+        }
+        state.transition_begin = entry.transition_begin;
+        state.transition_count = entry.transition_end - entry.transition_begin;
 
-        while (!word_fit && break_index < len)
+        loaded_states.emplace_back(state);
+    }
+
+    // Optional chunks are recognized by their magic
+    auto next_chunk_is = [&cursor](const char *magic)
+    {
+        return cursor.remaining().size() >= 4 && std::string_view(cursor.remaining().data(), 4) == magic;
+    };
+
+    // "hsh0" held hashes of an older scheme that depended on state ids, so they are skipped and recomputed
+    if (next_chunk_is("hsh0"))
+    {
+        std::vector<uint64_t> hash_storage;
+        read_chunk(cursor, "hsh0", &hash_storage);
+    }
+    std::vector<uint64_t> loaded_hashes;
+    if (next_chunk_is("hsh1"))
+    {
+        std::vector<uint64_t> hash_storage;
+        std::span<const uint64_t> stored_hashes = read_chunk(cursor, "hsh1", &hash_storage);
+        if (stored_hashes.size() != loaded_states.size())
         {
-            for (unsigned int i = break_index; i < len; i++)
-            {
-                uint32_t cluster = infos[i].cluster;
-                if (cluster != current_cluster)
-                {
-                    string_index++;
-                    current_cluster = cluster;
-
-                    if (line_length + anchor.x >= window_dimensions.x - margin)
-                    {
-                        token_length = string_index - break_string_index;
-                        break_string_index = string_index;
-                        break_index = i;
-                        no_break = false;
-                        break;
-                    }
-                    line_length += acc;
-                    acc = 0.0f;
-                }
-                acc += pos[i].x_advance / 55.0f;
-            }
+            throw std::runtime_error("Story file '" + filename + "' has " + std::to_string(stored_hashes.size()) + " state hashes for " + std::to_string(loaded_states.size()) + " states");
+        }
+        loaded_hashes.assign(stored_hashes.begin(), stored_hashes.end());
+    }
+    else
+    {
+        loaded_hashes = hash_states(loaded_states, loaded_transitions);
+    }
 
-            if (no_break)
+    ShapingInfo loaded_shaping;
+    std::vector<GlyphRange> loaded_glyph_ranges;
+    std::vector<ShapedGlyph> loaded_glyphs;
+    if (next_chunk_is("shp0"))
+    {
+        std::vector<ShapingInfo> shaping_storage;
+        std::span<const ShapingInfo> stored_shaping = read_chunk(cursor, "shp0", &shaping_storage);
+        std::vector<GlyphRange> range_storage;
+        std::span<const GlyphRange> stored_ranges = read_chunk(cursor, "gix0", &range_storage);
+        std::vector<ShapedGlyph> glyph_storage;
+        std::span<const ShapedGlyph> stored_glyphs = read_chunk(cursor, "gly0", &glyph_storage);
+
+        if (stored_shaping.size() != 1 || stored_ranges.size() != loaded_states.size() + loaded_transitions.size())
+        {
+            throw std::runtime_error("Story file '" + filename + "' has malformed shaped text");
+        }
+
+        // Every glyph must point into the text it was shaped from
+        auto check = [&](const GlyphRange &range, std::string_view text)
+        {
+            if (!(range.begin <= range.end && range.end <= stored_glyphs.size()))
             {
-                line.append(word.substr(break_string_index, word.length() - break_string_index) + ' ');
-                word_fit = true;
+                throw std::runtime_error("Story file '" + filename + "' has shaped text with invalid glyph indices");
             }
-            else if (line.empty())
+            for (uint32_t g = range.begin; g < range.end; g++)
             {
-                line.append(word.substr(break_string_index - token_length, token_length));
-                output.emplace_back(line);
-                line = std::string();
-                line_length = 0;
-                token_length = 0;
-                break_index++;
-
-                if (break_string_index >= word.length() - 1)
+                if (stored_glyphs[g].cluster >= text.size())
                 {
-                    line.append(word.substr(break_string_index, word.length() - break_string_index));
-                    output.emplace_back(line);
-                    line = std::string();
-                    line_length = 0;
-
-                    word_fit = true;
+                    throw std::runtime_error("Story file '" + filename + "' has a shaped glyph outside of its text");
                 }
             }
-            else
-            {
-                output.emplace_back(line);
-                line = std::string();
-                break_index = 0;
-                token_length = 0;
-                break_string_index = 0;
-                string_index = 0;
-                word_fit = false;
-                no_break = true;
-                line_length = 0;
-            }
+        };
+        for (size_t i = 0; i < loaded_states.size(); i++)
+        {
+            check(stored_ranges[i], loaded_states[i].text);
+        }
+        for (size_t i = 0; i < loaded_transitions.size(); i++)
+        {
+            check(stored_ranges[loaded_states.size() + i], loaded_transitions[i].text);
         }
+
+        loaded_shaping = stored_shaping[0];
+        loaded_glyph_ranges.assign(stored_ranges.begin(), stored_ranges.end());
+        loaded_glyphs.assign(stored_glyphs.begin(), stored_glyphs.end());
     }
-    output.emplace_back(line);
-    return output;
+
+    if (!cursor.at_end())
+    {
+        throw std::runtime_error("Story file '" + filename + "' has trailing data");
+    }
+
+    // A new story rather than changing the current one in place, since copies may share it
+    std::shared_ptr<Story> loaded = std::make_shared<Story>();
+    loaded->states = std::move(loaded_states);
+    loaded->transitions = std::move(loaded_transitions);
+    loaded->hashes = std::move(loaded_hashes);
+    loaded->shaping = loaded_shaping;
+    loaded->glyph_ranges = std::move(loaded_glyph_ranges);
+    loaded->glyphs = std::move(loaded_glyphs);
+    loaded->file = mapped;
+    story = std::move(loaded);
+    shaped_run_count = 0;
 }
 
-StateMachine::StateMachine()
+StateMachine::Story &StateMachine::editable_story()
 {
-    states = std::vector<State>();
+    if (story.use_count() > 1)
+        story = std::make_shared<Story>(*story);
+    return *story;
 }
 
-StateMachine::StateMachine(std::vector<State> _states)
+void StateMachine::update_shaped_runs(uint32_t transition)
 {
-    states = std::vector(_states);
-    assert(states.size() != 0 && "Cannot pass an empty state vector to the constructor");
-    current_state = states[0];
-    text_to_display = current_state.text;
+    shaped_run_count = 0;
+    const Story &s = *story;
+    if (s.glyph_ranges.empty() || current >= s.states.size())
+        return;
+
+    auto glyphs_of = [&s](const GlyphRange &range)
+    {
+        return std::span<const ShapedGlyph>(s.glyphs.data() + range.begin, range.end - range.begin);
+    };
+    if (transition != -1U)
+    {
+        shaped_runs[shaped_run_count++] = ShapedText{s.transitions[transition].text, glyphs_of(s.glyph_ranges[s.states.size() + transition])};
+    }
+    shaped_runs[shaped_run_count++] = ShapedText{s.states[current].text, glyphs_of(s.glyph_ranges[current])};
 }
 
-StateMachine::StateMachine(const StateMachine *machine)
+void StateMachine::reserve_text()
 {
-    states = std::vector(machine->states);
-    current_state = machine->current_state;
-    text_to_display = current_state.text;
+    const std::vector<State> &states = story->states;
+    size_t longest = 0;
+    for (const State &state : states)
+    {
+        longest = std::max(longest, state.text.size());
+        for (const Transition &transition : transitions_from(state))
+        {
+            if (transition.dst_id != -1U && transition.dst_id < states.size())
+            {
+                longest = std::max(longest, transition.text.size() + 1 + states[transition.dst_id].text.size());
+            }
+        }
+    }
+    story->longest_text = longest;
+    text_to_display.reserve(longest);
 }
 
-void StateMachine::add_state(State state)
+void StateMachine::add_state(std::string_view text, std::span<const Transition> state_transitions)
 {
-    if (states.size() == 0)
+    Story &s = editable_story();
+
+    State state;
+    state.id = uint32_t(s.states.size());
+    state.text = text;
+    state.transition_begin = uint32_t(s.transitions.size());
+    state.transition_count = uint32_t(state_transitions.size());
+
+    s.transitions.insert(s.transitions.end(), state_transitions.begin(), state_transitions.end());
+    s.states.emplace_back(state);
+    // (the hashes of states leading to this one change too, now that it exists)
+    s.hashes = hash_states(s.states, s.transitions);
+    // Pre-shaped text no longer covers every state
+    s.shaping = ShapingInfo();
+    s.glyph_ranges.clear();
+    s.glyphs.clear();
+    reserve_text();
+
+    if (s.states.size() == 1)
     {
-        current_state = state;
-        text_to_display = state.text;
+        reset();
+    }
+    else
+    {
+        update_shaped_runs(-1U);
     }
-
-    states.emplace_back(state);
 }
 
-std::vector<StateMachine::State> StateMachine::get_states()
+bool StateMachine::switch_state(uint32_t transition)
 {
-    return states;
+    std::span<const Transition> choices = current_transitions();
+    if (transition >= choices.size())
+        return false;
+
+    const Transition &taken = choices[transition];
+    if (taken.dst_id == -1U)
+        return false;
+
+    current = taken.dst_id;
+    text_to_display.assign(taken.text);
+    text_to_display.push_back(' ');
+    text_to_display.append(story->states[current].text);
+    update_shaped_runs(uint32_t(&taken - story->transitions.data()));
+    return true;
 }
 
-void StateMachine::switch_state(Transition transition)
+void StateMachine::reset()
 {
-    if (transition.dst_id != -1U)
+    current = 0;
+    if (story->states.empty())
     {
-        text_to_display = std::string(transition.text);
-        current_state = states[transition.dst_id];
-        text_to_display.append(" ");
-        text_to_display.append(current_state.text);
+        // Nothing loaded yet (default constructor): there is no state to show
+        text_to_display.clear();
+        shaped_run_count = 0;
+        return;
     }
+    text_to_display.assign(story->states[0].text);
+    update_shaped_runs(-1U);
 }
 
-void StateMachine::reset() {
-    current_state = states[0];
-    text_to_display = current_state.text;
-}
-
-std::string StateMachine::to_string()
+std::string StateMachine::to_string() const
 {
     std::string out = "";
-    for (State state : states)
+    for (const State &state : story->states)
     {
         out.append("State ");
         out.append(std::to_string(state.id));
         out.append(" ");
         out.append(state.text);
         out.append("\n");
-        for (Transition transition : state.transitions)
+        for (const Transition &transition : transitions_from(state))
         {
             out.append("Transition ");
             out.append(std::to_string(transition.dst_id));
@@ -402,8 +461,15 @@ std::string StateMachine::to_string()
     return out;
 }
 
-void StateMachine::draw_current_state(glm::vec2 window_dimensions, glm::vec2 anchor, glm::vec3 colour)
+size_t StateMachine::memory_footprint() const
 {
-    tm.draw_text(text_to_display, window_dimensions, anchor, colour);
-    // std::cout << text_to_display << std::endl;
-}
\ No newline at end of file
+    const Story &s = *story;
+    size_t bytes = sizeof(*this) + sizeof(Story) + text_to_display.capacity();
+    bytes += s.states.capacity() * sizeof(State) + s.transitions.capacity() * sizeof(Transition) + s.hashes.capacity() * sizeof(uint64_t);
+    bytes += s.glyph_ranges.capacity() * sizeof(GlyphRange) + s.glyphs.capacity() * sizeof(ShapedGlyph);
+    if (s.file)
+    {
+        bytes += s.file->size;
+    }
+    return bytes;
+}
@@ -1,138 +1,174 @@
 #pragma once
 
 #include <vector>
+#include <array>
 #include <string>
+#include <string_view>
+#include <span>
+#include <memory>
 #include <unordered_map>
 #include <stdint.h>
 
-#include "GL.hpp"
+#include "MappedFile.hpp"
+#include "ShapedText.hpp"
 
-#include <glm/glm.hpp>
-#include <glm/gtc/quaternion.hpp>
-
-// FreeType
-#include <ft2build.h>
-#include FT_FREETYPE_H
-
-// HarfBuzz
-#include <hb.h>
-#include <hb-ft.h>
-
-constexpr uint32_t max_line_length = 1024;
-constexpr uint32_t max_transition = 2;
-
-struct TextManager
+// State machine
+struct StateMachine
 {
-    struct Glyph
+    // Entries of the binary story format written by the parser, made of three chunks:
+    //  "sta0": one StateEntry per state, in id order
+    //  "trn0": one TransitionEntry per transition, grouped by source state
+    //  "str0": UTF-8 text of every state and transition, back to back
+    // (the text comes last so that the entry chunks stay aligned when the file is mapped)
+    // optionally followed by:
+    //  "hsh1": one uint64_t hash_states() hash per state, in id order (computed on load if missing;
+    //          an older "hsh0" chunk of id-dependent hashes is skipped)
+    // and, for stories compiled with pre-shaped text:
+    //  "shp0": one ShapingInfo, the font the text was shaped with
+    //  "gix0": one GlyphRange per state, in id order, then one per transition
+    //  "gly0": ShapedGlyph of every state and transition text, back to back
+    struct StateEntry
     {
-        GLuint tex_id;
-        uint32_t width, height;
-        float advance;
-        float bearing_x, bearing_y;
+        uint32_t text_begin, text_end;             // Range of the state text in "str0"
+        uint32_t transition_begin, transition_end; // Range of the state transitions in "trn0"
     };
+    static_assert(sizeof(StateEntry) == 4 * 4, "StateEntry is packed.");
 
-    void load_glyph(hb_codepoint_t gid);
-
-    void draw_text(std::string str, glm::vec2 window_dimensions, glm::vec2 anchor, glm::vec3 colour);
-
-    TextManager();
-    ~TextManager();
-
-    TextManager operator=(const TextManager other)
+    struct TransitionEntry
     {
-        if (this == &other)
-            return *this;
-
-        this->ft_library = other.ft_library;
-        this->ft_face = other.ft_face;
-        this->hb_font = other.hb_font;
-        this->character_atlas = std::unordered_map(other.character_atlas);
-        this->program = other.program;
-        this->Position = other.Position;
-        this->Colour = other.Colour;
-        this->TexCoord = other.TexCoord;
-        this->vao = other.vao;
-        this->vbo = other.vbo;
-
-        return *this;
-    }
+        uint32_t dst_id;               // Id of the state to go to
+        uint32_t text_begin, text_end; // Range of the transition text in "str0"
+    };
+    static_assert(sizeof(TransitionEntry) == 3 * 4, "TransitionEntry is packed.");
 
-private:
-    // Libraries and fonts to draw the text
-    FT_Library ft_library;
-    FT_Face ft_face;
-    hb_font_t *hb_font;
-
-    // Font file and size
-    const char *font_file = "FreeSans.otf";
-    const int font_size = 36;
-    const int margin = font_size / 2;
-
-    // Map of all previously seen characters and their corresponding texture
-    std::unordered_map<hb_codepoint_t, Glyph> character_atlas;
-
-    // GL properties
-    GLuint program;
-    GLuint Position;
-    GLuint Colour;
-    GLuint TexCoord;
-    GLuint vao;
-    GLuint vbo;
-
-    std::vector<std::string> wrap_text(std::string str, glm::vec2 window_dimensions, glm::vec2 anchor);
-};
+    struct GlyphRange
+    {
+        uint32_t begin, end; // Range of the text glyphs in "gly0"
+    };
+    static_assert(sizeof(GlyphRange) == 2 * 4, "GlyphRange is packed.");
 
-// State machine
-struct StateMachine
-{
     // Transition struct for the state machine
     struct Transition
     {
-        uint32_t dst_id = -1;             // Id of the state to go to
-        char text[max_line_length] = {0}; // Text to display on transition
+        uint32_t dst_id = -1;  // Id of the state to go to
+        std::string_view text; // Text to display on transition
     };
 
     // State struct for the state machine
+    // The transitions of every state are stored back to back in one array, so a state only
+    // refers to its range of it (use transitions_from to get them).
     struct State
     {
-        uint32_t id = -1;                       // Index of the current state in the state machine
-        char text[max_line_length] = {0};       // Text to display on arriving to this state
-        Transition transitions[max_transition]; // Transitions from this state
+        uint32_t id = -1;              // Index of the current state in the state machine
+        std::string_view text;         // Text to display on arriving to this state
+        uint32_t transition_begin = 0; // Index of the first transition from this state
+        uint32_t transition_count = 0; // Number of transitions from this state
     };
 
     StateMachine();
-    StateMachine(std::vector<State> states);
-    StateMachine(const StateMachine *machine);
+    StateMachine(std::vector<State> states, std::vector<Transition> transitions);
+
+    // Copies share the story (which is read only once loaded), and only copy their place in it
+    StateMachine(const StateMachine &other);
+    StateMachine &operator=(const StateMachine &other);
+    StateMachine(StateMachine &&other) = default;
+    StateMachine &operator=(StateMachine &&other) = default;
 
-    void switch_state(Transition transition);
+    // Replace the states with the ones of a story file, which is mapped in memory
+    // throws on file format errors
+    void load(const std::string &filename);
 
-    void add_state(State state);
+    // Load a rebuilt story file in place of the current one, staying in the current state:
+    // it is found by its content hash (or by its id, if its own content was edited)
+    // returns the number of states that were edited, added or removed, by content hash
+    // throws on file format errors, in which case the current story is kept
+    // Note: the whole file is read again; unchanged states are not carried over from the old story
+    uint32_t reload(const std::string &filename);
 
+    // Content hash of each state, used to tell which states changed between builds: its text, the text of its
+    // transitions, and the text and transition texts of the states they lead to (destinations are hashed by
+    // content rather than id, since adding or removing a state renumbers the ones after it)
+    static std::vector<uint64_t> hash_states(std::span<const State> states, std::span<const Transition> transitions);
+
+    // Number of states edited, added or removed between two builds, from their hash_states() hashes
+    // (equal hashes are paired wherever the states are, so renumbered states don't count)
+    static uint32_t count_changed_states(std::span<const uint64_t> old_hashes, std::span<const uint64_t> new_hashes);
+
+    const std::vector<uint64_t> &state_hashes() const { return story->hashes; }
+
+    // Take transition number 'transition' of the current state, if it leads somewhere
+    // returns whether the state changed (no copies or allocations either way)
+    bool switch_state(uint32_t transition);
+
+    // Add a state with the given transitions (its id and transition range are assigned here)
+    // Note: the texts are not copied, they must outlive the state machine
+    void add_state(std::string_view text, std::span<const Transition> state_transitions);
+
+    // Go back to the first state (or to showing nothing, if there are no states)
     void reset();
 
-    std::vector<State> get_states();
+    const std::vector<State> &get_states() const { return story->states; }
 
-    std::string to_string();
+    std::string to_string() const;
 
-    void draw_current_state(glm::vec2 window_dimensions, glm::vec2 anchor, glm::vec3 colour);
+    // Text of the last transition taken followed by the text of the current state
+    const std::string &current_text() const { return text_to_display; }
 
-    State current_state;
+    // Glyphs of current_text() if the story was compiled with pre-shaped text, empty otherwise:
+    // a run for the transition text (if any), then one for the state text, joined by a space like the text
+    std::span<const ShapedText> current_shaped_text() const { return std::span<const ShapedText>(shaped_runs.data(), shaped_run_count); }
+
+    // Font and size the story text was shaped with (font_size is 0 if it wasn't)
+    const ShapingInfo &shaping_info() const { return story->shaping; }
+
+    // Bytes used by the loaded story: the mapped file and the decoded states
+    size_t memory_footprint() const;
+
+    const State &current_state() const
+    {
+        static const State no_state;
+        return story->states.empty() ? no_state : story->states[current];
+    }
 
-    StateMachine operator=(const StateMachine other)
+    std::span<const Transition> transitions_from(const State &state) const
     {
-        if (this == &other)
-            return *this;
-
-        this->current_state = other.current_state;
-        this->text_to_display = other.text_to_display;
-        this->states = std::vector(other.states);
-        
-        return this;
+        return std::span<const Transition>(story->transitions.data() + state.transition_begin, state.transition_count);
     }
 
+    std::span<const Transition> current_transitions() const { return transitions_from(current_state()); }
+
 private:
-    std::vector<State> states;
+    // Everything loaded from a story file, shared by copies of the state machine
+    struct Story
+    {
+        std::vector<State> states;
+        std::vector<Transition> transitions; // Transitions of all the states, grouped by source state
+        std::vector<uint64_t> hashes;        // hash_states() of the states
+
+        // Pre-shaped text, if the story file has it
+        ShapingInfo shaping;
+        std::vector<GlyphRange> glyph_ranges; // One per state, then one per transition
+        std::vector<ShapedGlyph> glyphs;
+
+        size_t longest_text = 0; // Longest transition and state text pair, see reserve_text()
+
+        // Mapped story file, the states hold views into its text
+        std::shared_ptr<const MappedFile> file;
+    };
+    std::shared_ptr<Story> story;
+    // Story that add_state can modify (copied first if other state machines share it)
+    Story &editable_story();
+
+    std::array<ShapedText, 2> shaped_runs;
+    uint32_t shaped_run_count = 0;
+    // Point shaped_runs at the glyphs of the current state, after those of a transition (-1U for none)
+    void update_shaped_runs(uint32_t transition);
+    uint32_t current = 0; // Index of the current state in the story
+
+    // Reused for every switch, with room reserved for the longest transition and state text pair
     std::string text_to_display;
+    void reserve_text();
 
-    TextManager tm = TextManager();
+    // Replace the story with the one of a story file (unchanged if it throws)
+    void read_story(const std::string &filename);
 };
\ No newline at end of file
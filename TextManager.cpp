@@ -0,0 +1,836 @@
+#include "TextManager.hpp"
+
+#include <assert.h>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+
+#include "gl_compile_program.hpp"
+#include "MappedFile.hpp"
+
+// Shaders taken from https://github.com/jialand/TheMuteLift#
+const GLchar *vertexSrc =
+    R"GLSL(
+        #version 330
+        layout(location=0) in vec2 aPos;
+        layout(location=1) in vec2 aUV;
+        out vec2 vUV;
+        uniform vec2 uScreen; // in pixels
+        void main(){
+            vUV = aUV;
+            // pixel -> NDC. Note: NDC y goes up; here (0,0) = top-left corner
+            float x = (aPos.x / uScreen.x) * 2.0 - 1.0;
+            float y = 1.0 - (aPos.y / uScreen.y) * 2.0;
+            gl_Position = vec4(x, y, 0.0, 1.0);
+        }
+    )GLSL";
+
+// The atlas holds signed distance fields: 0.5 on the glyph outline, more inside and less outside.
+// Antialiasing over one screen pixel (fwidth) keeps edges sharp at any drawing size.
+const GLchar *fragmentSrc =
+    R"GLSL(
+        #version 330
+        in vec2 vUV;
+        out vec4 FragColor;
+        uniform sampler2D uTex; // R8, red channel as distance
+        uniform vec3 uColor;
+        void main(){
+            float d = texture(uTex, vUV).r;
+            float w = max(fwidth(d), 1e-4);
+            float a = smoothstep(0.5 - w, 0.5 + w, d);
+            FragColor = vec4(uColor, a);
+        }
+    )GLSL";
+
+// OpenType features used for shaping (the story compiler uses the same ones)
+static const hb_feature_t shaping_features[] = {
+    {HB_TAG('k', 'e', 'r', 'n'), 1, 0, ~0u},
+    {HB_TAG('l', 'i', 'g', 'a'), 1, 0, ~0u},
+};
+
+TextManager::FontAtlas::FontAtlas()
+{
+    FT_Error ft_error;
+
+    if ((ft_error = FT_Init_FreeType(&ft_library)))
+    {
+        std::cout << "No library" << std::endl;
+        abort();
+    }
+    // (glyphs are only rendered with this library if the rasterizer thread fails, see upload_rasterized_glyphs)
+    FT_Int spread = sdf_spread;
+    FT_Property_Set(ft_library, "sdf", "spread", &spread);
+    FT_Property_Set(ft_library, "bsdf", "spread", &spread);
+
+    std::vector<std::string> candidates{font_file};
+    std::error_code ec;
+    std::vector<std::string> fallbacks;
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(fallback_font_directory, ec))
+    {
+        std::string extension = entry.path().extension().string();
+        if (entry.is_regular_file() && (extension == ".otf" || extension == ".ttf"))
+            fallbacks.emplace_back(entry.path().string());
+    }
+    std::sort(fallbacks.begin(), fallbacks.end());
+    candidates.insert(candidates.end(), fallbacks.begin(), fallbacks.end());
+
+    for (const std::string &file : candidates)
+    {
+        FT_Face ft_face;
+        if ((ft_error = FT_New_Face(ft_library, file.c_str(), 0, &ft_face)))
+        {
+            if (ft_faces.empty())
+            {
+                std::cout << "No Face " << ft_error << std::endl;
+                abort();
+            }
+            std::cerr << "Skipping fallback font '" << file << "' (error " << ft_error << ")" << std::endl;
+            continue;
+        }
+        if ((ft_error = FT_Set_Char_Size(ft_face, font_size * 64, font_size * 64, 0, 0)))
+        {
+            if (ft_faces.empty())
+            {
+                std::cout << "No Char size" << std::endl;
+                abort();
+            }
+            std::cerr << "Skipping fallback font '" << file << "' (error " << ft_error << ")" << std::endl;
+            FT_Done_Face(ft_face);
+            continue;
+        }
+
+        hb_font_t *hb_font = hb_ft_font_create(ft_face, NULL);
+        hb_ft_font_set_funcs(hb_font); // use FT-provided metric functions
+
+        // Coverage bitmap, so picking a font for a character doesn't have to probe the fonts
+        std::vector<uint64_t> &coverage = font_coverage.emplace_back(codepoint_count / 64, 0);
+        FT_UInt index;
+        for (FT_ULong codepoint = FT_Get_First_Char(ft_face, &index); index != 0; codepoint = FT_Get_Next_Char(ft_face, codepoint, &index))
+        {
+            if (codepoint < codepoint_count)
+                coverage[codepoint / 64] |= uint64_t(1) << (codepoint % 64);
+        }
+
+        font_files.emplace_back(file);
+        ft_faces.emplace_back(ft_face);
+        hb_fonts.emplace_back(hb_font);
+    }
+
+    hb_buffer = hb_buffer_create();
+
+    // Stories shaped by the compiler are only drawn from their glyphs if they used this very font
+    font_hash = hash_font_data(MappedFile(font_file).bytes());
+    if (!FT_Load_Glyph(ft_faces[0], FT_Get_Char_Index(ft_faces[0], ' '), FT_LOAD_DEFAULT))
+    {
+        space_advance = ft_faces[0]->glyph->advance.x / 64.0f;
+    }
+
+    // Taken from https://github.com/jialand/TheMuteLift#
+    program = gl_acquire_program(vertexSrc, fragmentSrc);
+    Position = glGetUniformLocation(program, "uScreen");
+    Colour = glGetUniformLocation(program, "uColor");
+    TexCoord = glGetUniformLocation(program, "uTex");
+
+    rasterizer = std::thread(&FontAtlas::rasterize_glyphs, this);
+}
+
+TextManager::FontAtlas::~FontAtlas()
+{
+    {
+        std::unique_lock<std::mutex> lock(rasterizer_mutex);
+        rasterizer_quit = true;
+    }
+    rasterizer_wake.notify_one();
+    rasterizer.join();
+
+    for (auto &page : pages)
+    {
+        if (page.tex_id)
+            glDeleteTextures(1, &page.tex_id);
+    }
+    hb_buffer_destroy(hb_buffer);
+    for (hb_font_t *hb_font : hb_fonts)
+        hb_font_destroy(hb_font);
+    for (FT_Face ft_face : ft_faces)
+        FT_Done_Face(ft_face);
+    FT_Done_FreeType(ft_library);
+    gl_release_program(program);
+}
+
+std::shared_ptr<TextManager::FontAtlas> TextManager::FontAtlas::get()
+{
+    // Only a weak reference is kept here, so the atlas goes away with the last TextManager
+    static std::weak_ptr<FontAtlas> shared;
+    std::shared_ptr<FontAtlas> atlas = shared.lock();
+    if (!atlas)
+    {
+        atlas = std::make_shared<FontAtlas>();
+        shared = atlas;
+    }
+    return atlas;
+}
+
+TextManager::TextManager() : atlas(FontAtlas::get())
+{
+}
+
+TextManager::LayoutBuffers::~LayoutBuffers()
+{
+    if (vbo)
+        glDeleteBuffers(1, &vbo);
+    if (vao)
+        glDeleteVertexArrays(1, &vao);
+}
+
+TextManager::LayoutBuffers::LayoutBuffers(LayoutBuffers &&other) noexcept : vao(other.vao), vbo(other.vbo)
+{
+    other.vao = 0;
+    other.vbo = 0;
+}
+
+TextManager::LayoutBuffers &TextManager::LayoutBuffers::operator=(LayoutBuffers &&other) noexcept
+{
+    std::swap(vao, other.vao);
+    std::swap(vbo, other.vbo);
+    return *this;
+}
+
+void TextManager::FontAtlas::allocate_in_atlas(uint32_t width, uint32_t height, uint32_t *page, uint32_t *x, uint32_t *y)
+{
+    uint32_t padded_width = width + atlas_padding;
+    uint32_t padded_height = height + atlas_padding;
+
+    if (padded_width > atlas_page_size || padded_height > atlas_page_size)
+    {
+        throw std::runtime_error("Glyph is too large to fit in an atlas page");
+    }
+
+    // Look for the shelf that wastes the least height among those with room left
+    for (uint32_t p = 0; p < pages.size(); p++)
+    {
+        AtlasPage &atlas_page = pages[p];
+
+        AtlasPage::Shelf *best = nullptr;
+        for (AtlasPage::Shelf &shelf : atlas_page.shelves)
+        {
+            if (shelf.height < padded_height || shelf.x + padded_width > atlas_page_size)
+                continue;
+            if (best == nullptr || shelf.height < best->height)
+                best = &shelf;
+        }
+
+        // Start a new shelf if no existing one fits
+        if (best == nullptr && atlas_page.next_shelf_y + padded_height <= atlas_page_size)
+        {
+            atlas_page.shelves.emplace_back(AtlasPage::Shelf{atlas_page.next_shelf_y, padded_height, 0});
+            atlas_page.next_shelf_y += padded_height;
+            best = &atlas_page.shelves.back();
+        }
+
+        if (best != nullptr)
+        {
+            *page = p;
+            *x = best->x;
+            *y = best->y;
+            best->x += padded_width;
+            return;
+        }
+    }
+
+    // Every page is full, grow the atlas by one page
+    AtlasPage atlas_page;
+    std::vector<uint8_t> zeros(atlas_page_size * atlas_page_size, 0);
+    glGenTextures(1, &atlas_page.tex_id);
+    glBindTexture(GL_TEXTURE_2D, atlas_page.tex_id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlas_page_size, atlas_page_size, 0, GL_RED, GL_UNSIGNED_BYTE, zeros.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    atlas_page.shelves.emplace_back(AtlasPage::Shelf{0, padded_height, padded_width});
+    atlas_page.next_shelf_y = padded_height;
+    pages.emplace_back(atlas_page);
+
+    *page = uint32_t(pages.size() - 1);
+    *x = 0;
+    *y = 0;
+}
+
+void TextManager::FontAtlas::rasterize_glyph(const std::vector<FT_Face> &faces, hb_codepoint_t gid, RasterizedGlyph *g)
+{
+    // The distance field extends sdf_spread pixels past the outline, and the bitmap offsets account for it
+    FT_Face face = faces[gid >> glyph_font_shift];
+    FT_Load_Glyph(face, gid & ((1u << glyph_font_shift) - 1), FT_LOAD_DEFAULT);
+    FT_GlyphSlot slot = face->glyph;
+    FT_Render_Glyph(slot, FT_RENDER_MODE_SDF);
+    const FT_Bitmap &bitmap = slot->bitmap;
+
+    g->gid = gid;
+    g->width = bitmap.width;
+    g->height = bitmap.rows;
+    g->bearing_x = float(slot->bitmap_left);
+    g->bearing_y = float(slot->bitmap_top);
+    g->advance = slot->advance.x / 64.0f;
+    g->pixels.resize(size_t(g->width) * g->height);
+    for (uint32_t row = 0; row < g->height; row++)
+    {
+        std::copy_n(bitmap.buffer + ptrdiff_t(row) * bitmap.pitch, g->width, g->pixels.data() + size_t(row) * g->width);
+    }
+}
+
+void TextManager::FontAtlas::rasterize_glyphs()
+{
+    // The same fonts as the main thread, which loaded them all already (but loading them again can still fail)
+    FT_Library library = nullptr;
+    std::vector<FT_Face> faces;
+    std::vector<hb_font_t *> fonts;
+    hb_buffer_t *buffer = nullptr;
+    auto release = [&]()
+    {
+        if (buffer)
+            hb_buffer_destroy(buffer);
+        for (hb_font_t *font : fonts)
+            hb_font_destroy(font);
+        for (FT_Face face : faces)
+            FT_Done_Face(face);
+        if (library)
+            FT_Done_FreeType(library);
+    };
+
+    std::string error;
+    if (FT_Init_FreeType(&library))
+    {
+        library = nullptr;
+        error = "no library";
+    }
+    else
+    {
+        // Glyphs are rendered as signed distance fields, covering sdf_spread pixels around their outlines
+        FT_Int spread = sdf_spread;
+        FT_Property_Set(library, "sdf", "spread", &spread);
+        FT_Property_Set(library, "bsdf", "spread", &spread);
+
+        for (const std::string &file : font_files)
+        {
+            FT_Face face;
+            if (FT_New_Face(library, file.c_str(), 0, &face))
+            {
+                error = "failed to load '" + file + "'";
+                break;
+            }
+            faces.emplace_back(face);
+            if (FT_Set_Char_Size(face, font_size * 64, font_size * 64, 0, 0))
+            {
+                error = "failed to size '" + file + "'";
+                break;
+            }
+            hb_font_t *font = hb_ft_font_create(face, NULL);
+            hb_ft_font_set_funcs(font);
+            fonts.emplace_back(font);
+        }
+    }
+    if (!error.empty())
+    {
+        release();
+        std::cerr << "Glyph rasterizer: " << error << ", rasterizing glyphs on the main thread instead" << std::endl;
+        std::unique_lock<std::mutex> lock(rasterizer_mutex);
+        rasterizer_failed = true;
+        return;
+    }
+    buffer = hb_buffer_create();
+
+    std::unordered_set<hb_codepoint_t> done; // Glyphs already rasterized
+    std::vector<hb_codepoint_t> glyphs;
+    std::vector<std::string> texts;
+    std::vector<ShapedGlyph> shaped;
+    std::vector<RasterizedGlyph> results;
+
+    std::unique_lock<std::mutex> lock(rasterizer_mutex);
+    while (true)
+    {
+        rasterizer_wake.wait(lock, [this]()
+                             { return rasterizer_quit || !requested_glyphs.empty() || !requested_texts.empty(); });
+        if (rasterizer_quit)
+            break;
+        glyphs.swap(requested_glyphs);
+        texts.swap(requested_texts);
+        lock.unlock();
+
+        // Texts to prewarm are shaped here, to find out which glyphs they need
+        for (const std::string &text : texts)
+        {
+            shaped.clear();
+            shape_text(text, fonts, buffer, &shaped);
+            for (const ShapedGlyph &glyph : shaped)
+                glyphs.emplace_back(glyph.gid);
+        }
+        texts.clear();
+
+        for (hb_codepoint_t gid : glyphs)
+        {
+            if (!done.insert(gid).second)
+                continue;
+            rasterize_glyph(faces, gid, &results.emplace_back());
+        }
+        glyphs.clear();
+
+        lock.lock();
+        rasterized_glyphs.insert(rasterized_glyphs.end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+        results.clear();
+    }
+    lock.unlock();
+
+    release();
+}
+
+void TextManager::FontAtlas::add_to_atlas(const RasterizedGlyph &rasterized)
+{
+    Glyph g;
+    g.page = 0;
+    g.width = rasterized.width;
+    g.height = rasterized.height;
+    g.bearing_x = rasterized.bearing_x;
+    g.bearing_y = rasterized.bearing_y;
+    g.advance = rasterized.advance;
+    g.uv_min = g.uv_max = glm::vec2(0.0f);
+
+    // Blank glyphs (e.g. spaces) only contribute an advance and take no room in the atlas
+    if (g.width != 0 && g.height != 0)
+    {
+        uint32_t x, y;
+        allocate_in_atlas(g.width, g.height, &g.page, &x, &y);
+
+        g.uv_min = glm::vec2(float(x), float(y)) / float(atlas_page_size);
+        g.uv_max = glm::vec2(float(x + g.width), float(y + g.height)) / float(atlas_page_size);
+
+        glBindTexture(GL_TEXTURE_2D, pages[g.page].tex_id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, g.width, g.height, GL_RED, GL_UNSIGNED_BYTE, rasterized.pixels.data());
+    }
+
+    character_atlas.emplace(std::pair(rasterized.gid, g));
+    pending_glyphs.erase(rasterized.gid);
+}
+
+void TextManager::FontAtlas::upload_rasterized_glyphs()
+{
+    bool failed;
+    {
+        std::unique_lock<std::mutex> lock(rasterizer_mutex);
+        uploading_glyphs.swap(rasterized_glyphs);
+        failed = rasterizer_failed;
+        if (failed)
+        {
+            // (nothing takes these requests anymore)
+            requested_glyphs.clear();
+            requested_texts.clear();
+        }
+    }
+
+    // If the rasterizer thread couldn't load the fonts, the glyphs requested from it so far are rasterized
+    // here, and get_glyph rasterizes the ones requested from now on
+    if (failed && !rasterize_here)
+    {
+        rasterize_here = true;
+        for (hb_codepoint_t gid : pending_glyphs)
+            rasterize_glyph(ft_faces, gid, &uploading_glyphs.emplace_back());
+    }
+
+    if (uploading_glyphs.empty())
+        return;
+
+    for (const RasterizedGlyph &rasterized : uploading_glyphs)
+    {
+        add_to_atlas(rasterized);
+    }
+    uploaded_glyphs += uploading_glyphs.size();
+    uploading_glyphs.clear();
+}
+
+const TextManager::Glyph *TextManager::FontAtlas::get_glyph(hb_codepoint_t gid)
+{
+    auto found = character_atlas.find(gid);
+    if (found != character_atlas.end())
+        return &found->second;
+
+    if (rasterize_here)
+    {
+        RasterizedGlyph rasterized;
+        rasterize_glyph(ft_faces, gid, &rasterized);
+        add_to_atlas(rasterized);
+        uploaded_glyphs += 1;
+        return &character_atlas.at(gid);
+    }
+
+    if (pending_glyphs.insert(gid).second)
+    {
+        {
+            std::unique_lock<std::mutex> lock(rasterizer_mutex);
+            requested_glyphs.emplace_back(gid);
+        }
+        rasterizer_wake.notify_one();
+    }
+    return nullptr;
+}
+
+void TextManager::FontAtlas::prewarm(std::string_view text)
+{
+    // (without the rasterizer thread, glyphs are rasterized as they are drawn)
+    if (rasterize_here)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(rasterizer_mutex);
+        requested_texts.emplace_back(text);
+    }
+    rasterizer_wake.notify_one();
+}
+
+void TextManager::add_glyph(Layout &layout, hb_codepoint_t gid, float x, float y, float scale)
+{
+    const Glyph *found = atlas->get_glyph(gid);
+    if (found == nullptr)
+    {
+        layout.complete = false;
+        return;
+    }
+    const Glyph &glyph = *found;
+    if (glyph.width == 0 || glyph.height == 0)
+        return;
+    float x0 = x + glyph.bearing_x * scale;
+    float y0 = y - glyph.bearing_y * scale;
+    float x1 = x0 + glyph.width * scale;
+    float y1 = y0 + glyph.height * scale;
+
+    float u0 = glyph.uv_min.x, v0 = glyph.uv_min.y;
+    float u1 = glyph.uv_max.x, v1 = glyph.uv_max.y;
+
+    if (layout.batches.size() <= glyph.page)
+        layout.batches.resize(glyph.page + 1);
+
+    std::vector<float> &batch = layout.batches[glyph.page];
+    batch.insert(batch.end(), {
+        x0, y0, u0, v0,
+        x1, y0, u1, v0,
+        x1, y1, u1, v1,
+
+        x0, y0, u0, v0,
+        x1, y1, u1, v1,
+        x0, y1, u0, v1});
+}
+
+void TextManager::invalidate_layouts()
+{
+    // Layouts are kept around (unused) so their storage is recycled by the next ones
+    for (Layout &layout : layouts)
+        layout.valid = false;
+}
+
+// Decode the UTF-8 character at text[*at] and move past it (malformed bytes decode to U+FFFD one at a time)
+static uint32_t next_codepoint(std::string_view text, size_t *at)
+{
+    uint8_t lead = uint8_t(text[*at]);
+    uint32_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xe ? 3 : (lead >> 3) == 0x1e ? 4 : 0;
+    if (length == 0 || *at + length > text.size())
+    {
+        *at += 1;
+        return 0xfffd;
+    }
+    uint32_t codepoint = length == 1 ? lead : lead & (0x7f >> length);
+    for (uint32_t i = 1; i < length; i++)
+    {
+        uint8_t continuation = uint8_t(text[*at + i]);
+        if ((continuation >> 6) != 0x2)
+        {
+            *at += 1;
+            return 0xfffd;
+        }
+        codepoint = (codepoint << 6) | (continuation & 0x3f);
+    }
+    *at += length;
+    return codepoint;
+}
+
+void TextManager::FontAtlas::shape_text(std::string_view text, const std::vector<hb_font_t *> &fonts, hb_buffer_t *buffer, std::vector<ShapedGlyph> *glyphs) const
+{
+    auto shape_run = [&](size_t begin, size_t end, uint32_t font)
+    {
+        // The whole text is given as context, so runs are shaped as they would be as part of it
+        hb_buffer_clear_contents(buffer);
+        hb_buffer_add_utf8(buffer, text.data(), int(text.size()), uint32_t(begin), int(end - begin));
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(fonts[font], buffer, shaping_features, sizeof(shaping_features) / sizeof(shaping_features[0]));
+
+        unsigned int len = hb_buffer_get_length(buffer);
+        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(buffer, NULL);
+        hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(buffer, NULL);
+        for (unsigned int i = 0; i < len; i++)
+        {
+            // Characters that no font has are drawn with the missing glyph (gid 0) of the run's font
+            uint32_t gid = (font << glyph_font_shift) | info[i].codepoint;
+            glyphs->emplace_back(ShapedGlyph{gid, info[i].cluster, pos[i].x_advance, pos[i].x_offset, pos[i].y_offset});
+        }
+    };
+
+    // Characters that belong with their neighbours: spaces, combining marks, joiners and variation selectors
+    auto attaches = [](uint32_t codepoint)
+    {
+        return codepoint == ' ' || (codepoint >= 0x300 && codepoint < 0x370) || codepoint == 0x200c || codepoint == 0x200d || (codepoint >= 0xfe00 && codepoint < 0xfe10);
+    };
+
+    // Split the text into runs of characters drawn with the same font, the first one of the chain that has
+    // them (characters that attach to their neighbours stay in the current run if its font has them)
+    size_t run_begin = 0;
+    uint32_t run_font = 0;
+    for (size_t at = 0; at < text.size();)
+    {
+        size_t character = at;
+        uint32_t codepoint = next_codepoint(text, &at);
+        if (covers(run_font, codepoint) && (run_font == 0 || attaches(codepoint)))
+            continue;
+
+        uint32_t font = run_font;
+        for (uint32_t f = 0; f < fonts.size(); f++)
+        {
+            if (covers(f, codepoint))
+            {
+                font = f;
+                break;
+            }
+        }
+        if (font != run_font)
+        {
+            if (character != run_begin)
+                shape_run(run_begin, character, run_font);
+            run_begin = character;
+            run_font = font;
+        }
+    }
+    if (run_begin < text.size())
+        shape_run(run_begin, text.size(), run_font);
+}
+
+void TextManager::layout_text(Layout &layout)
+{
+    // Shape the whole text at once, then break it into lines from its glyphs like pre-shaped text
+    shaped_glyphs.clear();
+    atlas->shape_text(layout.text, atlas->hb_fonts, atlas->hb_buffer, &shaped_glyphs);
+
+    ShapedText run{layout.text, shaped_glyphs};
+    layout_shaped(layout, std::span<const ShapedText>(&run, 1));
+}
+
+void TextManager::layout_shaped(Layout &layout, std::span<const ShapedText> runs)
+{
+    glm::vec2 anchor = layout.anchor;
+
+    // Glyphs are shaped at font_size, and scaled to the size the text is drawn at
+    const float scale = layout.size / FontAtlas::font_size;
+    const float units = scale / 64.0f; // Per 26.6 fixed point unit
+    float line_end = layout.window_dimensions.x - margin * scale;
+
+    float pen_x = anchor.x;
+    float pen_y = anchor.y;
+
+    auto new_line = [&]()
+    {
+        pen_x = anchor.x;
+        pen_y += layout.size;
+    };
+
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+        const ShapedText &run = runs[r];
+        const std::span<const ShapedGlyph> glyphs = run.glyphs;
+        auto is_space = [&run](const ShapedGlyph &glyph)
+        {
+            return run.text[glyph.cluster] == ' ';
+        };
+
+        // Runs are joined by a space, which is dropped at the start of a line like any other
+        if (r != 0 && pen_x != anchor.x)
+            pen_x += atlas->space_advance * scale;
+
+        size_t i = 0;
+        while (i < glyphs.size())
+        {
+            if (is_space(glyphs[i]))
+            {
+                if (pen_x != anchor.x)
+                    pen_x += glyphs[i].x_advance * units;
+                i++;
+                continue;
+            }
+
+            // Measure the word starting here, and move it to the next line if it doesn't fit on this one
+            size_t word_end = i;
+            float word_width = 0.0f;
+            while (word_end < glyphs.size() && !is_space(glyphs[word_end]))
+            {
+                word_width += glyphs[word_end].x_advance * units;
+                word_end++;
+            }
+            if (pen_x != anchor.x && pen_x + word_width > line_end)
+                new_line();
+
+            while (i < word_end)
+            {
+                // Words wider than a whole line are broken between clusters (never inside a ligature
+                // or between a letter and its accents)
+                size_t cluster_end = i + 1;
+                float cluster_width = glyphs[i].x_advance * units;
+                while (cluster_end < word_end && glyphs[cluster_end].cluster == glyphs[i].cluster)
+                {
+                    cluster_width += glyphs[cluster_end].x_advance * units;
+                    cluster_end++;
+                }
+                if (pen_x != anchor.x && pen_x + cluster_width > line_end)
+                    new_line();
+
+                for (; i < cluster_end; i++)
+                {
+                    const ShapedGlyph &shaped = glyphs[i];
+                    add_glyph(layout, shaped.gid, pen_x + shaped.x_offset * units, pen_y - shaped.y_offset * units, scale);
+                    pen_x += shaped.x_advance * units;
+                }
+            }
+        }
+    }
+}
+
+void TextManager::draw_text(const std::string &str, glm::vec2 window_dimensions, glm::vec2 anchor, float size, glm::vec3 colour, std::span<const ShapedText> shaped)
+{
+    // Layouts that were missing glyphs are redone once new glyphs are in the atlas
+    atlas->upload_rasterized_glyphs();
+    if (seen_uploaded_glyphs != atlas->uploaded_glyphs)
+    {
+        seen_uploaded_glyphs = atlas->uploaded_glyphs;
+        for (Layout &cached : layouts)
+        {
+            if (!cached.complete)
+                cached.valid = false;
+        }
+    }
+
+    // Look for a layout of this text that is still valid
+    Layout *layout = nullptr;
+    for (Layout &cached : layouts)
+    {
+        if (cached.valid && cached.window_dimensions == window_dimensions && cached.anchor == anchor && cached.size == size && cached.shaped == !shaped.empty() && cached.text == str)
+        {
+            layout = &cached;
+            break;
+        }
+    }
+
+    if (layout != nullptr)
+    {
+        stats.hits++;
+    }
+    else
+    {
+        stats.misses++;
+
+        // Recycle an unused layout (or the oldest one once the cache is full), keeping its storage
+        for (Layout &unused : layouts)
+        {
+            if (!unused.valid)
+            {
+                layout = &unused;
+                break;
+            }
+        }
+        if (layout == nullptr && layouts.size() < max_cached_layouts)
+        {
+            layouts.emplace_back();
+            layout = &layouts.back();
+        }
+        if (layout == nullptr)
+        {
+            layout = &layouts[next_evicted];
+            next_evicted = (next_evicted + 1) % max_cached_layouts;
+        }
+
+        layout->valid = true;
+        layout->complete = true;
+        layout->text.assign(str);
+        layout->window_dimensions = window_dimensions;
+        layout->anchor = anchor;
+        layout->size = size;
+        layout->shaped = !shaped.empty();
+        layout->uploaded = false;
+        for (std::vector<float> &batch : layout->batches)
+            batch.clear();
+        if (layout->shaped)
+            layout_shaped(*layout, shaped);
+        else
+            layout_text(*layout);
+    }
+
+    // Upload the quads of a layout only when it was just built, every page into one buffer
+    if (!layout->uploaded)
+    {
+        LayoutBuffers &buffers = layout->buffers;
+        if (buffers.vao == 0)
+        {
+            glGenVertexArrays(1, &buffers.vao);
+            glBindVertexArray(buffers.vao);
+            glGenBuffers(1, &buffers.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)(sizeof(float) * 2));
+            glBindVertexArray(0);
+        }
+
+        size_t total = 0;
+        for (const std::vector<float> &batch : layout->batches)
+            total += batch.size();
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+        glBufferData(GL_ARRAY_BUFFER, total * sizeof(float), nullptr, GL_STATIC_DRAW);
+        size_t offset = 0;
+        for (const std::vector<float> &batch : layout->batches)
+        {
+            if (!batch.empty())
+                glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(float), batch.size() * sizeof(float), batch.data());
+            offset += batch.size();
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        layout->uploaded = true;
+    }
+
+    glUseProgram(atlas->program);
+    glUniform2f(atlas->Position, float(window_dimensions.x), float(window_dimensions.y));
+    glUniform3f(atlas->Colour, colour.r, colour.g, colour.b);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(atlas->TexCoord, 0);
+
+    glBindVertexArray(layout->buffers.vao);
+
+    // Enable alpha blending for text rendering
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    // One draw call per atlas page that has glyphs on screen, each drawing its range of the buffer
+    GLint first = 0;
+    for (uint32_t p = 0; p < layout->batches.size(); p++)
+    {
+        const std::vector<float> &batch = layout->batches[p];
+        GLsizei count = GLsizei(batch.size() / 4);
+        if (count != 0)
+        {
+            glBindTexture(GL_TEXTURE_2D, atlas->pages[p].tex_id);
+            glDrawArrays(GL_TRIANGLES, first, count);
+        }
+        first += count;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+    glUseProgram(0);
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "GL.hpp"
+#include "ShapedText.hpp"
+
+#include <glm/glm.hpp>
+
+// FreeType
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_MODULE_H
+
+// HarfBuzz
+#include <hb.h>
+#include <hb-ft.h>
+
+struct TextManager
+{
+    struct Glyph
+    {
+        uint32_t page;          // Index of the atlas page holding the glyph bitmap
+        uint32_t width, height;
+        float advance;
+        float bearing_x, bearing_y;
+        glm::vec2 uv_min, uv_max; // Texture coordinates of the glyph in its atlas page
+    };
+
+    // Atlas page: one large GL_R8 texture that glyph distance fields are packed into, shelf by shelf
+    struct AtlasPage
+    {
+        struct Shelf
+        {
+            uint32_t y, height; // Vertical extent of the shelf in the page
+            uint32_t x;         // Horizontal position of the next free texel on the shelf
+        };
+
+        GLuint tex_id = 0;
+        std::vector<Shelf> shelves;
+        uint32_t next_shelf_y = 0; // Top of the unused space below the last shelf
+    };
+
+    // Counters for the layout cache used by draw_text
+    struct LayoutCacheStats
+    {
+        uint64_t hits = 0;   // Draws that reused a cached layout
+        uint64_t misses = 0; // Draws that had to shape and wrap the text
+    };
+
+    // Fonts, glyph atlas, rasterizer thread and GL program, which are slow to set up:
+    // one FontAtlas is shared by every TextManager that exists at the same time
+    struct FontAtlas
+    {
+        FontAtlas();
+        ~FontAtlas();
+
+        // Owns FreeType, HarfBuzz and GL objects, and a thread that refers to it
+        FontAtlas(const FontAtlas &) = delete;
+        FontAtlas &operator=(const FontAtlas &) = delete;
+
+        // The atlas of the existing TextManagers, or a new one if there are none
+        static std::shared_ptr<FontAtlas> get();
+
+        // Libraries and fonts to draw the text, one of each per font of the fallback chain
+        FT_Library ft_library;
+        std::vector<FT_Face> ft_faces;
+        std::vector<hb_font_t *> hb_fonts;
+        hb_buffer_t *hb_buffer; // Reused by every runtime shaping
+
+        // Font files and the size glyphs are shaped and rasterized at (text of any size is drawn from the same glyphs).
+        // Characters are drawn with the first font of the chain that has them: the main font, then the fallback
+        // fonts found in fallback_font_directory (in file name order).
+        const char *font_file = "FreeSans.otf";
+        const char *fallback_font_directory = "fonts";
+        std::vector<std::string> font_files;
+        static constexpr int font_size = 36;
+        static constexpr int sdf_spread = 4; // Pixels covered by the glyph distance fields on each side of an outline
+        uint64_t font_hash = 0;     // hash_font_data() of the font file, to recognize pre-shaped text
+        float space_advance = 0.0f; // Advance of a space, used between pre-shaped runs
+
+        // Codepoints each font has a glyph for, one bit per codepoint (read only once constructed,
+        // so the rasterizer thread uses them too)
+        static constexpr uint32_t codepoint_count = 0x110000;
+        std::vector<std::vector<uint64_t>> font_coverage;
+        bool covers(uint32_t font, uint32_t codepoint) const
+        {
+            return codepoint < codepoint_count && (font_coverage[font][codepoint / 64] >> (codepoint % 64)) & 1;
+        }
+
+        // Glyphs of every font share the atlas, with the index of their font in the chain above the glyph index
+        static constexpr uint32_t glyph_font_shift = 16;
+
+        // Shape a text with the font chain, each run of characters with the first font that has them,
+        // appending the glyphs (clusters are byte offsets in the text)
+        void shape_text(std::string_view text, const std::vector<hb_font_t *> &fonts, hb_buffer_t *buffer, std::vector<ShapedGlyph> *glyphs) const;
+
+        // Map of all previously seen glyphs (of every font) and their location in the atlas
+        std::unordered_map<hb_codepoint_t, Glyph> character_atlas;
+
+        // Glyph rendered by the rasterizer thread, waiting to be uploaded to the atlas
+        struct RasterizedGlyph
+        {
+            hb_codepoint_t gid;
+            uint32_t width, height;
+            float advance;
+            float bearing_x, bearing_y;
+            std::vector<uint8_t> pixels; // width * height distance values, row by row
+        };
+
+        // The rasterizer thread has its own FreeType and HarfBuzz objects (they aren't thread safe),
+        // the main thread only uploads its results to the atlas
+        std::thread rasterizer;
+        std::mutex rasterizer_mutex;
+        std::condition_variable rasterizer_wake;
+        bool rasterizer_quit = false;                   // Guarded by rasterizer_mutex
+        bool rasterizer_failed = false;                 // Guarded by rasterizer_mutex, set if the thread couldn't load the fonts
+        std::vector<hb_codepoint_t> requested_glyphs;   // Guarded by rasterizer_mutex
+        std::vector<std::string> requested_texts;       // Guarded by rasterizer_mutex, shaped then rasterized
+        std::vector<RasterizedGlyph> rasterized_glyphs; // Guarded by rasterizer_mutex
+        std::vector<RasterizedGlyph> uploading_glyphs;  // Main thread, swapped with rasterized_glyphs
+        std::unordered_set<hb_codepoint_t> pending_glyphs; // Main thread, requested but not in the atlas yet
+        bool rasterize_here = false;                    // Main thread, glyphs are rasterized by get_glyph once the thread failed
+
+        void rasterize_glyphs();
+        // Render the distance field of a glyph of one of the faces (whose library has the sdf spread set)
+        static void rasterize_glyph(const std::vector<FT_Face> &faces, hb_codepoint_t gid, RasterizedGlyph *glyph);
+        // Move the glyphs rasterized so far into the atlas, counting them in uploaded_glyphs
+        // (if the rasterizer thread failed, the glyphs it was asked for are rasterized here instead)
+        void upload_rasterized_glyphs();
+        // Copy a rasterized glyph into the atlas
+        void add_to_atlas(const RasterizedGlyph &rasterized);
+        uint64_t uploaded_glyphs = 0;
+
+        // Have the glyphs of a text rasterized in the background
+        void prewarm(std::string_view text);
+
+        // Atlas entry of a glyph, or nullptr (and a request to the rasterizer) if it isn't rasterized yet
+        // (rasterized right away if the rasterizer thread failed)
+        const Glyph *get_glyph(hb_codepoint_t gid);
+
+        // Glyph atlas pages, a new page is added whenever a glyph doesn't fit in the existing ones
+        static constexpr uint32_t atlas_page_size = 1024;
+        static constexpr uint32_t atlas_padding = 1; // Empty texels around each glyph so linear filtering doesn't bleed
+        std::vector<AtlasPage> pages;
+
+        // Find room for a width x height bitmap in the atlas, adding a page if needed
+        void allocate_in_atlas(uint32_t width, uint32_t height, uint32_t *page, uint32_t *x, uint32_t *y);
+
+        // GL properties
+        GLuint program;
+        GLuint Position;
+        GLuint Colour;
+        GLuint TexCoord;
+    };
+
+    // Draw str at size pixels per em, shaping it unless its glyphs are given in shaped (runs joined by a space,
+    // as in StateMachine::current_shaped_text(), shaped with a font for which can_draw_shaped() holds)
+    void draw_text(const std::string &str, glm::vec2 window_dimensions, glm::vec2 anchor, float size, glm::vec3 colour, std::span<const ShapedText> shaped = {});
+
+    // Whether text shaped with the given font and size can be drawn with this manager's font
+    bool can_draw_shaped(const ShapingInfo &info) const { return info.font_size == uint32_t(FontAtlas::font_size) && info.font_hash == atlas->font_hash; }
+
+    // Forget every cached layout (call when the text being displayed changes)
+    void invalidate_layouts();
+
+    // Have the glyphs of a text that will be drawn soon rasterized in the background, so that
+    // they are ready when it appears (glyphs first seen in draw_text are missing for a few frames)
+    void prewarm(std::string_view text) { atlas->prewarm(text); }
+
+    LayoutCacheStats layout_cache_stats() const { return stats; }
+
+    // Uses the shared FontAtlas, only creating it if no other TextManager exists
+    TextManager();
+
+    // Layouts belong to one TextManager, so it can be moved but not copied
+    TextManager(const TextManager &) = delete;
+    TextManager &operator=(const TextManager &) = delete;
+    TextManager(TextManager &&) = default;
+    TextManager &operator=(TextManager &&) = default;
+
+private:
+    std::shared_ptr<FontAtlas> atlas;
+    uint64_t seen_uploaded_glyphs = 0; // atlas->uploaded_glyphs when incomplete layouts were last checked
+
+    static constexpr int margin = FontAtlas::font_size / 2;
+
+    // Vertex array and buffer holding the quads of one layout, freed with it (so layouts can only be moved)
+    struct LayoutBuffers
+    {
+        GLuint vao = 0;
+        GLuint vbo = 0;
+
+        LayoutBuffers() = default;
+        ~LayoutBuffers();
+        LayoutBuffers(const LayoutBuffers &) = delete;
+        LayoutBuffers &operator=(const LayoutBuffers &) = delete;
+        LayoutBuffers(LayoutBuffers &&other) noexcept;
+        LayoutBuffers &operator=(LayoutBuffers &&other) noexcept;
+    };
+
+    // Final glyph quads of a shaped and wrapped text, along with what they were computed for
+    struct Layout
+    {
+        std::string text;
+        glm::vec2 window_dimensions;
+        glm::vec2 anchor;
+        float size;
+        bool shaped; // Laid out from pre-shaped glyphs
+        bool valid;  // False once invalidated, the layout is then only kept for its storage
+        bool complete; // False if some glyphs weren't rasterized yet, laid out again once they are
+
+        // Vertex batches (x, y, u, v), one per atlas page
+        std::vector<std::vector<float>> batches;
+
+        // The batches, one after the other, as uploaded to the GL when the layout was last built
+        // (a cached layout is drawn without uploading anything)
+        LayoutBuffers buffers;
+        bool uploaded; // False until the batches are in buffers
+    };
+
+    // Layouts of the texts drawn since the last invalidation
+    static constexpr uint32_t max_cached_layouts = 16;
+    std::vector<Layout> layouts;
+    uint32_t next_evicted = 0; // Layout replaced next when every layout is in use (round robin)
+    LayoutCacheStats stats;
+
+    // Glyphs of the text being laid out by layout_text
+    std::vector<ShapedGlyph> shaped_glyphs;
+
+    // Shape a whole text once, then break it into lines with layout_shaped
+    void layout_text(Layout &layout);
+    // Break shaped glyphs into lines at spaces, in a single pass, and emit their quads
+    void layout_shaped(Layout &layout, std::span<const ShapedText> runs);
+
+    // Append the quad of a glyph whose origin is at (x, y), scaled from font_size, to the layout
+    void add_glyph(Layout &layout, hb_codepoint_t gid, float x, float y, float scale);
+};
\ No newline at end of file
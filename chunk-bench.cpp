@@ -0,0 +1,102 @@
+//Compares the two ways of reading chunk-based assets (.pnct, .scene, .story):
+// - "istream": read_chunk() into std::vectors through an std::ifstream
+// - "mmap": read_chunk() spans pointing into a MappedFile
+//
+//Run each mode in its own process so that peak memory use can be compared:
+//  $ ./chunk-bench istream dist/hexapod.pnct
+//  $ ./chunk-bench mmap dist/hexapod.pnct
+
+#include "read_write_chunk.hpp"
+#include "MappedFile.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+//peak resident set size, in kilobytes (or 0 if unknown on this platform):
+static uint64_t peak_rss_kb() {
+#if defined(_WIN32)
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	#if defined(__APPLE__)
+	return uint64_t(usage.ru_maxrss) / 1024; //reported in bytes
+	#else
+	return uint64_t(usage.ru_maxrss); //reported in kilobytes
+	#endif
+#endif
+}
+
+//read every chunk of the file (whatever its magic) and checksum its bytes, so both modes touch all the data:
+static uint64_t read_with_istream(std::string const &filename, uint32_t *chunks) {
+	std::ifstream file(filename, std::ios::binary);
+	uint64_t checksum = 0;
+	while (file.peek() != EOF) {
+		char magic[4];
+		if (!file.read(magic, 4)) throw std::runtime_error("Failed to read chunk magic.");
+		file.seekg(-4, std::ios::cur);
+
+		std::vector< char > data;
+		read_chunk(file, std::string(magic, 4), &data);
+		for (char c : data) checksum += uint8_t(c);
+		*chunks += 1;
+	}
+	return checksum;
+}
+
+static uint64_t read_with_mmap(std::string const &filename, uint32_t *chunks) {
+	MappedFile file(filename);
+	ChunkCursor cursor(file.bytes());
+	uint64_t checksum = 0;
+	while (!cursor.at_end()) {
+		if (cursor.remaining().size() < 4) throw std::runtime_error("Failed to read chunk magic.");
+		std::string magic(cursor.remaining().data(), 4);
+
+		std::span< char const > data = read_chunk< char >(cursor, magic);
+		for (char c : data) checksum += uint8_t(c);
+		*chunks += 1;
+	}
+	return checksum;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3 || !(std::strcmp(argv[1], "istream") == 0 || std::strcmp(argv[1], "mmap") == 0)) {
+		std::cerr << "Usage:\n\t./chunk-bench <istream|mmap> <file>" << std::endl;
+		return 1;
+	}
+	std::string mode = argv[1];
+	std::string filename = argv[2];
+
+	constexpr uint32_t Iterations = 10;
+
+	uint64_t baseline_kb = peak_rss_kb();
+	uint64_t checksum = 0;
+	uint32_t chunks = 0;
+
+	auto before = std::chrono::high_resolution_clock::now();
+	for (uint32_t iter = 0; iter < Iterations; ++iter) {
+		chunks = 0;
+		if (mode == "istream") {
+			checksum = read_with_istream(filename, &chunks);
+		} else {
+			checksum = read_with_mmap(filename, &chunks);
+		}
+	}
+	auto after = std::chrono::high_resolution_clock::now();
+
+	double ms = std::chrono::duration< double >(after - before).count() * 1000.0 / Iterations;
+
+	std::cout << mode << ": '" << filename << "' (" << chunks << " chunks, checksum " << checksum << ")\n";
+	std::cout << "  load time: " << ms << " ms (average of " << Iterations << ")\n";
+	std::cout << "  peak RSS: " << peak_rss_kb() << " kB (" << baseline_kb << " kB before loading)" << std::endl;
+
+	return 0;
+}
@@ -1,9 +1,31 @@
 #include "gl_compile_program.hpp"
 
+#include "data_path.hpp"
+#include "read_write_chunk.hpp"
+
+#include <SDL3/SDL.h>
+
 #include <vector>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <cassert>
+#include <cstdio>
+
+//program binaries are core in OpenGL 4.1 (GL_ARB_get_program_binary), so they aren't in GL.hpp:
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
 
 static GLuint gl_compile_shader(GLenum type, std::string const &source) {
 	GLuint shader = glCreateShader(type);
@@ -27,9 +49,11 @@ static GLuint gl_compile_shader(GLenum type, std::string const &source) {
 	return shader;
 }
 
-GLuint gl_compile_program(
+//compile and link a program, asking the driver to keep its binary around if 'program_parameteri' is given:
+static GLuint gl_link_program(
 	std::string const &vertex_shader_source,
-	std::string const &fragment_shader_source
+	std::string const &fragment_shader_source,
+	void (APIENTRY *program_parameteri)(GLuint, GLenum, GLint)
 	) {
 
 	GLuint vertex_shader = gl_compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
@@ -43,6 +67,11 @@ GLuint gl_compile_program(
 	glDeleteShader(vertex_shader);
 	glDeleteShader(fragment_shader);
 
+	//the binary hint has to be set before linking:
+	if (program_parameteri) {
+		program_parameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	//link the shader program and throw errors if linking fails:
 	glLinkProgram(program);
 	GLint link_status = GL_FALSE;
@@ -55,8 +84,230 @@ GLuint gl_compile_program(
 		GLsizei length = 0;
 		glGetProgramInfoLog(program, GLint(info_log.size()), &length, &info_log[0]);
 		std::cerr << "Info log: " << std::string(info_log.begin(), info_log.begin() + length);
+		glDeleteProgram(program);
 		throw std::runtime_error("failed to link program");
 	}
 
 	return program;
 }
+
+GLuint gl_compile_program(
+	std::string const &vertex_shader_source,
+	std::string const &fragment_shader_source
+	) {
+	return gl_link_program(vertex_shader_source, fragment_shader_source, nullptr);
+}
+
+//------------------------------------------------
+//program cache:
+
+//FNV-1a, continuing from 'hash':
+static uint64_t hash_bytes(std::string const &bytes, uint64_t hash = 0xcbf29ce484222325ull) {
+	for (char c : bytes) {
+		hash ^= uint8_t(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+//hash of a pair of sources; the length of the vertex shader comes first so that
+// moving text from one source to the other changes the hash:
+static uint64_t hash_sources(std::string const &vertex_shader_source, std::string const &fragment_shader_source) {
+	uint64_t vertex_length = vertex_shader_source.size();
+	std::string length_bytes(reinterpret_cast< char const * >(&vertex_length), sizeof(vertex_length));
+	uint64_t hash = hash_bytes(length_bytes);
+	hash = hash_bytes(vertex_shader_source, hash);
+	return hash_bytes(fragment_shader_source, hash);
+}
+
+//entry points for program binaries, if the driver has them:
+struct ProgramBinaries {
+	void (APIENTRY *GetProgramBinary)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary) = nullptr;
+	void (APIENTRY *ProgramBinary)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length) = nullptr;
+	void (APIENTRY *ProgramParameteri)(GLuint program, GLenum pname, GLint value) = nullptr;
+	uint64_t driver_hash = 0; //binaries only load on the same driver, so this is part of their file names
+	bool supported() const { return GetProgramBinary && ProgramBinary && ProgramParameteri; }
+};
+
+//looked up the first time a program is acquired (there is a GL context by then):
+static ProgramBinaries const &program_binaries() {
+	static ProgramBinaries binaries = []() {
+		ProgramBinaries ret;
+		if (!SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) return ret;
+		//some drivers have the extension but no binary formats, in which case saving would always fail:
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		if (formats <= 0) return ret;
+
+		ret.GetProgramBinary = (decltype(ret.GetProgramBinary))SDL_GL_GetProcAddress("glGetProgramBinary");
+		ret.ProgramBinary = (decltype(ret.ProgramBinary))SDL_GL_GetProcAddress("glProgramBinary");
+		ret.ProgramParameteri = (decltype(ret.ProgramParameteri))SDL_GL_GetProcAddress("glProgramParameteri");
+
+		for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+			GLubyte const *str = glGetString(name);
+			ret.driver_hash = hash_bytes(str ? reinterpret_cast< char const * >(str) : "", ret.driver_hash);
+		}
+		return ret;
+	}();
+	return binaries;
+}
+
+static std::string program_cache_path(uint64_t source_hash, uint64_t driver_hash) {
+	char name[64];
+	std::snprintf(name, sizeof(name), "%016llx-%016llx.program",
+		(unsigned long long)source_hash, (unsigned long long)driver_hash);
+	return data_path("program-cache/") + name;
+}
+
+//load a program saved by save_program_binary, returns 0 if there is none, it was made from other sources
+// (file names are only a hash of the sources), or the driver rejects it:
+//Expected format (see read_write_chunk.hpp):
+// "vsh0": the vertex shader source
+// "fsh0": the fragment shader source
+// "fmt0": one GLenum, the binary format
+// "bin0": the program binary
+static GLuint load_program_binary(
+	ProgramBinaries const &binaries,
+	std::string const &path,
+	std::string const &vertex_shader_source,
+	std::string const &fragment_shader_source
+	) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return 0;
+
+	std::vector< char > vertex_source;
+	std::vector< char > fragment_source;
+	std::vector< GLenum > format;
+	std::vector< char > binary;
+	try {
+		read_chunk(file, "vsh0", &vertex_source);
+		read_chunk(file, "fsh0", &fragment_source);
+		read_chunk(file, "fmt0", &format);
+		read_chunk(file, "bin0", &binary);
+	} catch (std::exception &e) {
+		std::cerr << "Ignoring program cache file '" << path << "': " << e.what() << std::endl;
+		return 0;
+	}
+	if (std::string_view(vertex_source.data(), vertex_source.size()) != vertex_shader_source) return 0;
+	if (std::string_view(fragment_source.data(), fragment_source.size()) != fragment_shader_source) return 0;
+	if (format.size() != 1 || binary.empty()) return 0;
+
+	GLuint program = glCreateProgram();
+	binaries.ProgramBinary(program, format[0], binary.data(), GLsizei(binary.size()));
+	//a driver update can make old binaries unusable, they are then compiled again (and overwritten):
+	GLint link_status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+	if (link_status != GL_TRUE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+static void save_program_binary(
+	ProgramBinaries const &binaries,
+	GLuint program,
+	std::string const &path,
+	std::string const &vertex_shader_source,
+	std::string const &fragment_shader_source
+	) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+
+	std::vector< GLenum > format(1, 0);
+	std::vector< char > binary(length);
+	GLsizei got = 0;
+	binaries.GetProgramBinary(program, length, &got, &format[0], binary.data());
+	binary.resize(got);
+	if (binary.empty()) return;
+
+	//the cache is only an optimization, so failing to write it is not an error:
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+	//written next to the cache file then renamed over it, so a run that is interrupted (or another
+	// instance of the game loading the same program) never sees a partly written file:
+	std::string temporary = path + ".tmp";
+	bool written = false;
+	{
+		std::ofstream file(temporary, std::ios::binary);
+		write_chunk("vsh0", std::vector< char >(vertex_shader_source.begin(), vertex_shader_source.end()), &file);
+		write_chunk("fsh0", std::vector< char >(fragment_shader_source.begin(), fragment_shader_source.end()), &file);
+		write_chunk("fmt0", format, &file);
+		write_chunk("bin0", binary, &file);
+		file.close();
+		written = bool(file);
+	}
+	if (written) {
+		std::filesystem::rename(temporary, path, ec);
+		written = !ec;
+	}
+	if (!written) {
+		std::cerr << "Failed to write program cache file '" << path << "'." << std::endl;
+		std::filesystem::remove(temporary, ec);
+	}
+}
+
+struct CachedProgram {
+	GLuint program = 0;
+	uint32_t users = 0; //deleted when this drops to zero
+	std::string vertex_shader_source; //checked on lookup, since different sources can have the same hash
+	std::string fragment_shader_source;
+};
+
+//programs currently in use, by hash of their sources:
+static std::unordered_multimap< uint64_t, CachedProgram > &cached_programs() {
+	static std::unordered_multimap< uint64_t, CachedProgram > programs;
+	return programs;
+}
+
+GLuint gl_acquire_program(
+	std::string const &vertex_shader_source,
+	std::string const &fragment_shader_source
+	) {
+
+	uint64_t source_hash = hash_sources(vertex_shader_source, fragment_shader_source);
+
+	auto &programs = cached_programs();
+	auto [first, last] = programs.equal_range(source_hash);
+	for (auto it = first; it != last; ++it) {
+		CachedProgram &cached = it->second;
+		if (cached.vertex_shader_source != vertex_shader_source || cached.fragment_shader_source != fragment_shader_source) continue;
+		cached.users += 1;
+		return cached.program;
+	}
+
+	ProgramBinaries const &binaries = program_binaries();
+	GLuint program = 0;
+	if (binaries.supported()) {
+		std::string path = program_cache_path(source_hash, binaries.driver_hash);
+		program = load_program_binary(binaries, path, vertex_shader_source, fragment_shader_source);
+		if (!program) {
+			program = gl_link_program(vertex_shader_source, fragment_shader_source, binaries.ProgramParameteri);
+			save_program_binary(binaries, program, path, vertex_shader_source, fragment_shader_source);
+		}
+	} else {
+		program = gl_link_program(vertex_shader_source, fragment_shader_source, nullptr);
+	}
+
+	programs.emplace(source_hash, CachedProgram{program, 1, vertex_shader_source, fragment_shader_source});
+	return program;
+}
+
+void gl_release_program(GLuint program) {
+	if (program == 0) return;
+
+	auto &programs = cached_programs();
+	for (auto it = programs.begin(); it != programs.end(); ++it) {
+		if (it->second.program != program) continue;
+		assert(it->second.users > 0);
+		it->second.users -= 1;
+		if (it->second.users == 0) {
+			glDeleteProgram(program);
+			programs.erase(it);
+		}
+		return;
+	}
+	assert(false && "gl_release_program called on a program that gl_acquire_program didn't return");
+}
@@ -9,3 +9,15 @@
 GLuint gl_compile_program(
 	std::string const &vertex_shader_source,
 	std::string const &fragment_shader_source);
+
+//like gl_compile_program, but programs are shared: asking again for the same sources
+// returns the same program, which is deleted once every user has released it.
+//when the driver supports program binaries, linked programs are also saved in
+// data_path("program-cache/") and loaded from there on later runs instead of being compiled.
+// throws on compilation error.
+GLuint gl_acquire_program(
+	std::string const &vertex_shader_source,
+	std::string const &fragment_shader_source);
+
+//give up one use of a program returned by gl_acquire_program:
+void gl_release_program(GLuint program);
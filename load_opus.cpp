@@ -7,6 +7,7 @@
 #include <cmath>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
 
 void load_opus(std::string const &filename, std::vector< float > *data_) {
 	assert(data_);
@@ -52,3 +53,65 @@ void load_opus(std::string const &filename, std::vector< float > *data_) {
 
 	std::cout << " done." << std::endl;
 }
+
+OpusStream::OpusStream(std::string const &filename_, bool loop_) : filename(filename_), loop(loop_) {
+	int err = 0;
+	op = op_open_file(filename.c_str(), &err);
+	if (err != 0 || op == nullptr) {
+		throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\".");
+	}
+	ring.assign(Capacity, 0.0f);
+	pcm.assign(2*5760, 0.0f); //5760 samples per channel is the largest (120ms) opus frame
+}
+
+OpusStream::~OpusStream() {
+	op_free(op);
+}
+
+void OpusStream::decode_ahead() {
+	if (end_of_file.load(std::memory_order_relaxed)) return;
+
+	uint64_t written = write_count.load(std::memory_order_relaxed);
+	bool just_looped = false;
+	//keep going while a whole opus frame is sure to fit:
+	while (Capacity - (written - read_count.load(std::memory_order_acquire)) >= pcm.size() / 2) {
+		int ret = op_read_float_stereo(op, pcm.data(), int(pcm.size()));
+		if (ret < 0) {
+			std::cerr << "WARNING: opusfile read error " << ret << " streaming \"" << filename << "\"; stopping stream." << std::endl;
+			end_of_file.store(true, std::memory_order_release);
+			break;
+		}
+		if (ret == 0) {
+			//end of file, either start again or stop:
+			if (loop && !just_looped && op_pcm_seek(op, 0) == 0) {
+				just_looped = true;
+				continue;
+			}
+			end_of_file.store(true, std::memory_order_release);
+			break;
+		}
+		just_looped = false;
+
+		for (uint32_t i = 0; i < uint32_t(ret); ++i) {
+			ring[(written + i) % Capacity] = (pcm[2*i] + pcm[2*i+1]) * 0.5f; //downmix to mono by averaging
+		}
+		written += uint32_t(ret);
+		write_count.store(written, std::memory_order_release);
+	}
+}
+
+std::span< float const > OpusStream::peek(uint32_t max_count) const {
+	uint64_t read = read_count.load(std::memory_order_relaxed);
+	uint64_t available = write_count.load(std::memory_order_acquire) - read;
+	uint32_t start = uint32_t(read % Capacity);
+	uint32_t count = uint32_t(std::min< uint64_t >({ uint64_t(max_count), available, uint64_t(Capacity - start) }));
+	return std::span< float const >(ring.data() + start, count);
+}
+
+void OpusStream::consume(uint32_t count) {
+	read_count.store(read_count.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+bool OpusStream::finished() const {
+	return done_decoding() && read_count.load(std::memory_order_relaxed) == write_count.load(std::memory_order_acquire);
+}
@@ -2,6 +2,50 @@
 
 #include <string>
 #include <vector>
+#include <span>
+#include <atomic>
+#include <cstdint>
 
 //Load an opus file as 48kHz floating-point mono; throws on error:
 void load_opus(std::string const &filename, std::vector< float > *data);
+
+//OpusStream decodes an opus file a bit at a time (as 48kHz floating-point mono) into a ring buffer:
+// one thread calls decode_ahead() to fill the buffer while another (the audio thread) reads from it.
+// (decoding and reading may happen at the same time, but each should only be done by one thread)
+struct OggOpusFile;
+struct OpusStream {
+	//opens the file; throws on error:
+	OpusStream(std::string const &filename, bool loop);
+	~OpusStream();
+
+	OpusStream(OpusStream const &) = delete;
+	OpusStream &operator=(OpusStream const &) = delete;
+
+	//decoding thread: decode until the buffer is nearly full or the file is done:
+	// (errors during decoding are reported and end the stream, rather than throwing)
+	void decode_ahead();
+
+	//reading thread: the next contiguous run of decoded samples, at most max_count long:
+	// (shorter than requested at the end of the ring buffer or if decoding is behind)
+	std::span< float const > peek(uint32_t max_count) const;
+	//reading thread: mark samples returned by peek() as used:
+	void consume(uint32_t count);
+
+	//has the whole file been decoded?
+	bool done_decoding() const { return end_of_file.load(std::memory_order_acquire); }
+	//has the whole file been decoded and read?
+	bool finished() const;
+
+	//internals:
+	std::string filename;
+	OggOpusFile *op = nullptr;
+	bool loop = false;
+
+	static constexpr uint32_t Capacity = 1 << 16; //samples in the ring buffer (~1.4 seconds); power of two
+	std::vector< float > ring;
+	std::atomic< uint64_t > read_count = 0; //total samples read; written by the reading thread
+	std::atomic< uint64_t > write_count = 0; //total samples decoded; written by the decoding thread
+	std::atomic< bool > end_of_file = false;
+
+	std::vector< float > pcm; //stereo samples from the decoder, before downmixing
+};
@@ -3,73 +3,588 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <chrono>
+#include <thread>
 #include "read_write_chunk.hpp"
+#include "MappedFile.hpp"
 
 Parser::Parser()
 {
-    story = {};
+    story_text = {};
+    states = {};
+    transitions = {};
 }
 
 Parser::~Parser() {}
 
+namespace
+{
+    // Single pass over a mapped story source. Positions are byte offsets, which are only turned
+    // into line and column numbers when reporting an error.
+    struct Tokenizer
+    {
+        const std::string &filename;
+        std::span<const char> source;
+        size_t at = 0;
+
+        [[noreturn]] void error(size_t offset, const std::string &message) const
+        {
+            size_t line = 1;
+            size_t line_start = 0;
+            for (const char *nl = source.data(); (nl = (const char *)memchr(nl, '\n', source.data() + offset - nl)); nl++)
+            {
+                line++;
+                line_start = nl - source.data() + 1;
+            }
+            throw std::runtime_error(filename + ":" + std::to_string(line) + ":" + std::to_string(offset - line_start + 1) + ": " + message);
+        }
+
+        std::string describe(size_t offset) const
+        {
+            if (offset >= source.size())
+                return "end of file";
+            return std::string("'") + source[offset] + "'";
+        }
+
+        void skip_whitespace()
+        {
+            while (at < source.size() && isspace((unsigned char)source[at]))
+                at++;
+        }
+
+        bool at_end()
+        {
+            skip_whitespace();
+            return at == source.size();
+        }
+
+        bool next_is(char c)
+        {
+            skip_whitespace();
+            return at < source.size() && source[at] == c;
+        }
+
+        void expect(char c)
+        {
+            if (!next_is(c))
+                error(at, std::string("expected '") + c + "', got " + describe(at) + ".");
+            at++;
+        }
+
+        // Unsigned number, or -1 (which is kept as 0xffffffff)
+        uint32_t number(const char *what)
+        {
+            skip_whitespace();
+            size_t start = at;
+            if (at + 1 < source.size() && source[at] == '-' && source[at + 1] == '1' && !(at + 2 < source.size() && isdigit((unsigned char)source[at + 2])))
+            {
+                at += 2;
+                return -1U;
+            }
+            uint64_t value = 0;
+            while (at < source.size() && isdigit((unsigned char)source[at]))
+            {
+                value = value * 10 + uint64_t(source[at] - '0');
+                if (value >= 0xffffffffull)
+                    error(start, std::string(what) + " is too large.");
+                at++;
+            }
+            if (at == start)
+                error(at, std::string("expected ") + what + ", got " + describe(at) + ".");
+            return uint32_t(value);
+        }
+
+        // Raw text up to the next '|', which is consumed
+        std::span<const char> text()
+        {
+            size_t start = at;
+            const char *bar = (const char *)memchr(source.data() + at, '|', source.size() - at);
+            if (!bar)
+                error(start, "text is missing its closing '|'.");
+            at = bar - source.data() + 1;
+            return source.subspan(start, at - 1 - start);
+        }
+    };
+}
+
 void Parser::parse_story(const std::string &filename)
 {
-    std::ifstream file(filename);
+    MappedFile file(filename);
+    Tokenizer tokens{filename, file.bytes()};
+
+    story_text.clear();
+    states.clear();
+    transitions.clear();
+    story_text.reserve(file.size);
+
+    // Append text up to the next '|' to the story text and return its range
+    auto read_text = [&](uint32_t *begin, uint32_t *end)
+    {
+        size_t start = tokens.at;
+        std::span<const char> text = tokens.text();
+        if (story_text.size() + text.size() > 0xffffffffull)
+            tokens.error(start, "story text is larger than the story format allows (4 GiB).");
+        *begin = uint32_t(story_text.size());
+        story_text.insert(story_text.end(), text.begin(), text.end());
+        *end = uint32_t(story_text.size());
+    };
 
     // Get the number of states from the file
-    uint32_t nb_states;
-    file >> nb_states;
+    uint32_t nb_states = tokens.number("number of states");
+    if (nb_states == -1U)
+        tokens.error(0, "number of states can't be -1.");
 
-    uint32_t state_id;
-    while (file >> state_id)
+    while (!tokens.at_end())
     {
-        StateMachine::State current_state;
-        current_state.id = state_id;
+        size_t state_start = tokens.at;
+        uint32_t state_id = tokens.number("state id");
+        if (state_id != states.size())
+            tokens.error(state_start, "expected state " + std::to_string(states.size()) + ", got state " + std::to_string(state_id) + " (states should be written in order).");
+        if (state_id >= nb_states)
+            tokens.error(state_start, "state " + std::to_string(state_id) + " is past the " + std::to_string(nb_states) + " states declared at the top of the file.");
 
-        char c;
-        file >> c;
-        // Checking proper formatting
-        if (c != '{')
-        {
-            std::string err = "Improper formatting, was expecting '{', got '";
-            err += c;
-            err.append("'.");
-            throw std::invalid_argument(err);
-        }
+        StateMachine::StateEntry current_state;
+        tokens.expect('{');
 
         // Get the state text
-        file.getline(current_state.text, max_line_length, '|');
+        read_text(&current_state.text_begin, &current_state.text_end);
 
-        // Get the transitions form current_state
-        uint32_t transition_index = 0;
-        c = file.peek();
-        while (c != '}')
+        // Get the transitions from current_state
+        current_state.transition_begin = uint32_t(transitions.size());
+        while (!tokens.next_is('}'))
         {
-            assert(transition_index < max_transition && "Too many transitions from current state.");
-            StateMachine::Transition t;
+            StateMachine::TransitionEntry t;
 
-            file >> t.dst_id;
+            size_t dst_start = tokens.at;
+            t.dst_id = tokens.number("transition destination or '}'");
+            if (t.dst_id != -1U && t.dst_id >= nb_states)
+                tokens.error(dst_start, "transition to state " + std::to_string(t.dst_id) + ", but only " + std::to_string(nb_states) + " states are declared.");
 
             // Get the transition text
-            file.getline(t.text, max_line_length, '|');
-            current_state.transitions[transition_index] = t;
+            read_text(&t.text_begin, &t.text_end);
+            transitions.emplace_back(t);
+        }
+        current_state.transition_end = uint32_t(transitions.size());
+        tokens.expect('}');
+
+        states.emplace_back(current_state);
+    }
+
+    if (states.size() != nb_states)
+        tokens.error(tokens.at, "found " + std::to_string(states.size()) + " states, but " + std::to_string(nb_states) + " are declared at the top of the file.");
+
+    // Hash every state, so rebuilds can tell which states changed
+    auto view = [this](uint32_t begin, uint32_t end)
+    {
+        return std::string_view(story_text.data() + begin, end - begin);
+    };
+    std::vector<StateMachine::State> hashed_states;
+    hashed_states.reserve(states.size());
+    for (const StateMachine::StateEntry &entry : states)
+    {
+        StateMachine::State state;
+        state.id = uint32_t(hashed_states.size());
+        state.text = view(entry.text_begin, entry.text_end);
+        state.transition_begin = entry.transition_begin;
+        state.transition_count = entry.transition_end - entry.transition_begin;
+        hashed_states.emplace_back(state);
+    }
+    std::vector<StateMachine::Transition> hashed_transitions;
+    hashed_transitions.reserve(transitions.size());
+    for (const StateMachine::TransitionEntry &entry : transitions)
+    {
+        hashed_transitions.emplace_back(StateMachine::Transition{entry.dst_id, view(entry.text_begin, entry.text_end)});
+    }
+    hashes = StateMachine::hash_states(hashed_states, hashed_transitions);
+}
 
-            transition_index++;
-            c = file.peek();
+void Parser::shape_story(const std::string &font_filename, uint32_t font_size)
+{
+    MappedFile font(font_filename);
+
+    FT_Library ft_library;
+    if (FT_Init_FreeType(&ft_library))
+        throw std::runtime_error("Failed to initialize FreeType.");
+    FT_Face ft_face;
+    if (FT_New_Memory_Face(ft_library, (const FT_Byte *)font.bytes().data(), FT_Long(font.bytes().size()), 0, &ft_face))
+    {
+        FT_Done_FreeType(ft_library);
+        throw std::runtime_error("Failed to load font '" + font_filename + "'.");
+    }
+    FT_Set_Char_Size(ft_face, font_size * 64, font_size * 64, 0, 0);
+
+    // Same setup as TextManager, so the glyphs match what it would shape at runtime
+    hb_font_t *hb_font = hb_ft_font_create(ft_face, NULL);
+    hb_ft_font_set_funcs(hb_font);
+    hb_buffer_t *hb_buffer = hb_buffer_create();
+    hb_feature_t features[] = {
+        {HB_TAG('k', 'e', 'r', 'n'), 1, 0, ~0u},
+        {HB_TAG('l', 'i', 'g', 'a'), 1, 0, ~0u},
+    };
+
+    glyph_ranges.clear();
+    glyph_ranges.reserve(states.size() + transitions.size());
+    glyphs.clear();
+
+    std::string error;
+    auto shape = [&](uint32_t text_begin, uint32_t text_end, const std::string &what)
+    {
+        hb_buffer_clear_contents(hb_buffer);
+        hb_buffer_add_utf8(hb_buffer, story_text.data() + text_begin, int(text_end - text_begin), 0, int(text_end - text_begin));
+        hb_buffer_guess_segment_properties(hb_buffer);
+        hb_shape(hb_font, hb_buffer, features, sizeof(features) / sizeof(features[0]));
+
+        unsigned int len = hb_buffer_get_length(hb_buffer);
+        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, NULL);
+        hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(hb_buffer, NULL);
+
+        StateMachine::GlyphRange range;
+        range.begin = uint32_t(glyphs.size());
+        for (unsigned int i = 0; i < len; i++)
+        {
+            if (info[i].codepoint == 0)
+            {
+                error = "The text of " + what + " contains characters not defined in '" + font_filename + "' (text that needs fallback fonts can't be pre-shaped).";
+                return false;
+            }
+            glyphs.emplace_back(ShapedGlyph{info[i].codepoint, info[i].cluster, pos[i].x_advance, pos[i].x_offset, pos[i].y_offset});
         }
-        file >> c;
+        range.end = uint32_t(glyphs.size());
+        glyph_ranges.emplace_back(range);
+        return true;
+    };
 
-        story.emplace_back(current_state);
+    bool shaped = true;
+    for (uint32_t s = 0; shaped && s < states.size(); s++)
+        shaped = shape(states[s].text_begin, states[s].text_end, "state " + std::to_string(s));
+    for (uint32_t t = 0; shaped && t < transitions.size(); t++)
+        shaped = shape(transitions[t].text_begin, transitions[t].text_end, "transition " + std::to_string(t));
+
+    hb_buffer_destroy(hb_buffer);
+    hb_font_destroy(hb_font);
+    FT_Done_Face(ft_face);
+    FT_Done_FreeType(ft_library);
+
+    if (!shaped)
+    {
+        glyph_ranges.clear();
+        glyphs.clear();
+        throw std::runtime_error(error);
     }
 
-    // assert(story.size() == nb_states && "Invalid number of states in the state machine, does not match number specified at the top of the file");
+    shaping.font_size = font_size;
+    shaping.font_hash = hash_font_data(font.bytes());
+}
 
-    std::string atlas = std::filesystem::path(filename).stem();
-    std::ofstream out("./parsing/" + atlas + ".story", std::ios::binary);
-    write_chunk("stry", story, &out);
-    out.close();
+#if defined(_WIN32)
+// Windows doesn't let a file be replaced while a running game has it mapped, but it can be moved out of
+// the way (MappedFile opens it with FILE_SHARE_DELETE): move it to a free "<filename>.old<n>", removing
+// the ones that no game has mapped anymore
+static void move_aside(const std::string &filename)
+{
+    for (uint32_t n = 0; n < 16; n++)
+    {
+        std::string old = filename + ".old" + std::to_string(n);
+        std::error_code ec;
+        std::filesystem::remove(old, ec);
+        if (std::filesystem::exists(old, ec))
+            continue; // Still mapped by a game
+        std::filesystem::rename(filename, old, ec);
+        return;
+    }
+}
+#endif
 
-    file.close();
+void Parser::write_story(const std::string &filename) const
+{
+    // Write next to the output and rename over it, so a running game that has the old file
+    // mapped keeps seeing the old contents until it reloads
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("Failed to open '" + temporary + "' for writing.");
+        write_chunk("sta0", states, &out);
+        write_chunk("trn0", transitions, &out);
+        write_chunk("str0", story_text, &out);
+        write_chunk("hsh1", hashes, &out);
+        if (shaping.font_size != 0)
+        {
+            write_chunk("shp0", std::vector<ShapingInfo>{shaping}, &out);
+            write_chunk("gix0", glyph_ranges, &out);
+            write_chunk("gly0", glyphs, &out);
+        }
+        if (!out)
+            throw std::runtime_error("Failed to write '" + temporary + "'.");
+    }
+
+    // Retry for a moment, in case another program (a game loading it, a virus scanner) briefly has the file open
+    for (uint32_t attempt = 0;; attempt++)
+    {
+        std::error_code ec;
+        std::filesystem::rename(temporary, filename, ec);
+        if (!ec)
+            break;
+        if (attempt == 20)
+        {
+            std::string error = "Failed to replace '" + filename + "' with the new story (" + ec.message() + "); if a running game has it open, quit the game and build again.";
+            std::filesystem::remove(temporary, ec);
+            throw std::runtime_error(error);
+        }
+#if defined(_WIN32)
+        move_aside(filename);
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+Parser::Analysis Parser::analyze_story() const
+{
+    Analysis analysis;
+    const uint32_t n = uint32_t(states.size());
+
+    // Adjacency of the states, keeping only transitions that lead somewhere
+    auto targets = [this](uint32_t state, auto &&fn)
+    {
+        for (uint32_t t = states[state].transition_begin; t < states[state].transition_end; t++)
+        {
+            if (transitions[t].dst_id != -1U)
+                fn(transitions[t].dst_id);
+        }
+    };
+
+    // Reverse adjacency in CSR form, to walk back from the endings
+    std::vector<uint32_t> reverse_begin(n + 1, 0);
+    for (uint32_t s = 0; s < n; s++)
+        targets(s, [&](uint32_t d) { reverse_begin[d + 1]++; });
+    for (uint32_t s = 0; s < n; s++)
+        reverse_begin[s + 1] += reverse_begin[s];
+    std::vector<uint32_t> reverse_sources(reverse_begin[n]);
+    {
+        std::vector<uint32_t> fill(reverse_begin.begin(), reverse_begin.end() - 1);
+        for (uint32_t s = 0; s < n; s++)
+            targets(s, [&](uint32_t d) { reverse_sources[fill[d]++] = s; });
+    }
+
+    // Breadth-first search from state 0 for reachability and shortest distances
+    analysis.distance.assign(n, -1U);
+    std::vector<uint32_t> queue;
+    queue.reserve(n);
+    if (n > 0)
+    {
+        analysis.distance[0] = 0;
+        queue.push_back(0);
+    }
+    for (size_t q = 0; q < queue.size(); q++)
+    {
+        uint32_t s = queue[q];
+        targets(s, [&](uint32_t d)
+                {
+            if (analysis.distance[d] == -1U)
+            {
+                analysis.distance[d] = analysis.distance[s] + 1;
+                queue.push_back(d);
+            } });
+    }
+    for (uint32_t s = 0; s < n; s++)
+    {
+        if (analysis.distance[s] == -1U)
+        {
+            analysis.unreachable.push_back(s);
+            continue;
+        }
+        bool ending = true;
+        targets(s, [&](uint32_t) { ending = false; });
+        if (ending)
+        {
+            analysis.endings.push_back(s);
+            analysis.shortest_ending = std::min(analysis.shortest_ending, analysis.distance[s]);
+        }
+    }
+
+    // Breadth-first search backwards from the endings: reachable states it misses are trapped
+    std::vector<bool> finishes(n, false);
+    queue.clear();
+    for (uint32_t s : analysis.endings)
+    {
+        finishes[s] = true;
+        queue.push_back(s);
+    }
+    for (size_t q = 0; q < queue.size(); q++)
+    {
+        uint32_t s = queue[q];
+        for (uint32_t r = reverse_begin[s]; r < reverse_begin[s + 1]; r++)
+        {
+            if (!finishes[reverse_sources[r]])
+            {
+                finishes[reverse_sources[r]] = true;
+                queue.push_back(reverse_sources[r]);
+            }
+        }
+    }
+    for (uint32_t s = 0; s < n; s++)
+    {
+        if (analysis.distance[s] != -1U && !finishes[s])
+            analysis.trapped.push_back(s);
+    }
+
+    // Tarjan's strongly connected components, with an explicit stack so deep stories can't overflow
+    // Components are numbered in the order they complete, which is a reverse topological order
+    analysis.component.assign(n, -1U);
+    std::vector<uint32_t> index(n, -1U), lowlink(n, 0), scc_stack;
+    std::vector<bool> on_stack(n, false);
+    struct Frame
+    {
+        uint32_t state;
+        uint32_t next_transition;
+    };
+    std::vector<Frame> call_stack;
+    uint32_t next_index = 0;
+    for (uint32_t root = 0; root < n; root++)
+    {
+        if (index[root] != -1U)
+            continue;
+        call_stack.push_back(Frame{root, states[root].transition_begin});
+        index[root] = lowlink[root] = next_index++;
+        scc_stack.push_back(root);
+        on_stack[root] = true;
+
+        while (!call_stack.empty())
+        {
+            Frame &frame = call_stack.back();
+            uint32_t s = frame.state;
+            if (frame.next_transition < states[s].transition_end)
+            {
+                uint32_t d = transitions[frame.next_transition++].dst_id;
+                if (d == -1U)
+                    continue;
+                if (index[d] == -1U)
+                {
+                    index[d] = lowlink[d] = next_index++;
+                    scc_stack.push_back(d);
+                    on_stack[d] = true;
+                    call_stack.push_back(Frame{d, states[d].transition_begin});
+                }
+                else if (on_stack[d])
+                {
+                    lowlink[s] = std::min(lowlink[s], index[d]);
+                }
+                continue;
+            }
+
+            // All transitions of s are done: close its component if it is the root of one
+            if (lowlink[s] == index[s])
+            {
+                uint32_t c = analysis.components++;
+                uint32_t member;
+                do
+                {
+                    member = scc_stack.back();
+                    scc_stack.pop_back();
+                    on_stack[member] = false;
+                    analysis.component[member] = c;
+                } while (member != s);
+            }
+            call_stack.pop_back();
+            if (!call_stack.empty())
+            {
+                uint32_t parent = call_stack.back().state;
+                lowlink[parent] = std::min(lowlink[parent], lowlink[s]);
+            }
+        }
+    }
+
+    // Components with a cycle: more than one state, or a state that transitions to itself
+    std::vector<uint32_t> component_size(analysis.components, 0);
+    std::vector<bool> component_cycle(analysis.components, false);
+    for (uint32_t s = 0; s < n; s++)
+    {
+        uint32_t c = analysis.component[s];
+        if (++component_size[c] > 1)
+            component_cycle[c] = true;
+        targets(s, [&](uint32_t d)
+                {
+            if (d == s)
+                component_cycle[c] = true; });
+    }
+    {
+        std::vector<uint32_t> cycle_of(analysis.components, -1U);
+        for (uint32_t s = 0; s < n; s++)
+        {
+            uint32_t c = analysis.component[s];
+            if (!component_cycle[c] || analysis.distance[s] == -1U)
+                continue;
+            if (cycle_of[c] == -1U)
+            {
+                cycle_of[c] = uint32_t(analysis.cycles.size());
+                analysis.cycles.emplace_back();
+            }
+            analysis.cycles[cycle_of[c]].push_back(s);
+        }
+    }
+
+    // Longest path over the condensation (a DAG), visiting components sinks first
+    if (n > 0)
+    {
+        std::vector<uint32_t> member_begin(analysis.components + 1, 0), member_states(n);
+        for (uint32_t s = 0; s < n; s++)
+            member_begin[analysis.component[s] + 1]++;
+        for (uint32_t c = 0; c < analysis.components; c++)
+            member_begin[c + 1] += member_begin[c];
+        {
+            std::vector<uint32_t> fill(member_begin.begin(), member_begin.end() - 1);
+            for (uint32_t s = 0; s < n; s++)
+                member_states[fill[analysis.component[s]]++] = s;
+        }
+
+        std::vector<uint32_t> longest(analysis.components, 0);
+        for (uint32_t c = 0; c < analysis.components; c++)
+        {
+            for (uint32_t m = member_begin[c]; m < member_begin[c + 1]; m++)
+            {
+                targets(member_states[m], [&](uint32_t d)
+                        {
+                    uint32_t dc = analysis.component[d];
+                    if (dc != c)
+                        longest[c] = std::max(longest[c], longest[dc] + 1); });
+            }
+        }
+        analysis.longest_path = longest[analysis.component[0]];
+    }
+
+    return analysis;
+}
+
+void Parser::write_report(const Analysis &analysis, std::ostream &out) const
+{
+    auto list = [&out](const char *title, const std::vector<uint32_t> &ids)
+    {
+        out << title << " (" << ids.size() << "):";
+        for (uint32_t id : ids)
+            out << " " << id;
+        out << "\n";
+    };
+
+    out << "States: " << states.size() << ", transitions: " << transitions.size() << "\n";
+    out << "Reachable from state 0: " << states.size() - analysis.unreachable.size() << "\n";
+    out << "Strongly connected components: " << analysis.components << " (" << analysis.cycles.size() << " reachable with cycles)\n";
+    if (analysis.shortest_ending == -1U)
+        out << "Shortest path to an ending: none\n";
+    else
+        out << "Shortest path to an ending: " << analysis.shortest_ending << " transitions\n";
+    out << "Longest path between components: " << analysis.longest_path << " transitions" << (analysis.cycles.empty() ? "" : " (not counting repeats around cycles)") << "\n";
+
+    list("Unreachable states", analysis.unreachable);
+    list("Endings", analysis.endings);
+    list("Trapped states (can't reach an ending)", analysis.trapped);
+    for (size_t c = 0; c < analysis.cycles.size(); c++)
+    {
+        std::string title = "Cycle " + std::to_string(c);
+        list(title.c_str(), analysis.cycles[c]);
+    }
 }
 
 // StateMachine::StateMachine()
@@ -82,8 +597,127 @@ void Parser::parse_story(const std::string &filename)
 //     states = std::vector(_states);
 // }
 
-int main()
+int main(int argc, char **argv)
 {
-    Parser parser;
-    parser.parse_story("story.txt");
+    // Usage: utility [story.txt] [-o output.story] [--report report.txt] [--shape font.otf] [--font-size 36]
+    std::string input = "story.txt";
+    std::string output;
+    std::string report;
+    std::string shape_font;
+    uint32_t font_size = 36;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-o" || arg == "--output") && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (arg == "--report" && i + 1 < argc)
+        {
+            report = argv[++i];
+        }
+        else if (arg == "--shape" && i + 1 < argc)
+        {
+            shape_font = argv[++i];
+        }
+        else if (arg == "--font-size" && i + 1 < argc)
+        {
+            font_size = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg.size() > 0 && arg[0] != '-')
+        {
+            input = arg;
+        }
+        else
+        {
+            std::cerr << "Usage:\n\t./utility [story.txt] [-o output.story] [--report report.txt] [--shape font.otf] [--font-size 36]" << std::endl;
+            return 1;
+        }
+    }
+    if (output.empty())
+    {
+        output = "./parsing/" + std::filesystem::path(input).stem().string() + ".story";
+    }
+
+    try
+    {
+        Parser parser;
+        parser.parse_story(input);
+        if (!shape_font.empty())
+        {
+            if (font_size == 0)
+                throw std::runtime_error("The font size must be a positive number of pixels.");
+            parser.shape_story(shape_font, font_size);
+        }
+
+        // Check the story graph: problems are warnings, since a story in progress often has some
+        Parser::Analysis analysis = parser.analyze_story();
+        if (!analysis.unreachable.empty())
+            std::cerr << "Warning: " << analysis.unreachable.size() << " states can't be reached from state 0 (first: " << analysis.unreachable[0] << ")." << std::endl;
+        if (!analysis.trapped.empty())
+            std::cerr << "Warning: " << analysis.trapped.size() << " reachable states can't reach an ending (first: " << analysis.trapped[0] << ")." << std::endl;
+        if (analysis.endings.empty())
+            std::cerr << "Warning: the story has no reachable ending." << std::endl;
+        if (!report.empty())
+        {
+            std::ofstream out(report);
+            parser.write_report(analysis, out);
+            if (!out)
+                throw std::runtime_error("Failed to write report '" + report + "'.");
+        }
+
+        // Compare with the previous build, and leave it alone if no state changed or moved and the text
+        // was shaped the same way (so that it isn't needlessly reloaded by a running game)
+        std::vector<uint64_t> previous_hashes;
+        std::vector<uint32_t> previous_destinations;
+        ShapingInfo previous_shaping;
+        if (std::filesystem::exists(output))
+        {
+            try
+            {
+                StateMachine previous;
+                previous.load(output);
+                previous_hashes = previous.state_hashes();
+                for (const StateMachine::State &state : previous.get_states())
+                {
+                    for (const StateMachine::Transition &transition : previous.transitions_from(state))
+                        previous_destinations.emplace_back(transition.dst_id);
+                }
+                previous_shaping = previous.shaping_info();
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "Ignoring previous '" << output << "': " << e.what() << std::endl;
+            }
+        }
+        uint32_t changed = StateMachine::count_changed_states(previous_hashes, parser.hashes);
+
+        // (the hashes don't depend on state ids, so renumbered states are caught by comparing them in order)
+        bool renumbered = previous_hashes != parser.hashes || previous_destinations.size() != parser.transitions.size();
+        for (size_t t = 0; t < parser.transitions.size() && !renumbered; t++)
+        {
+            renumbered = previous_destinations[t] != parser.transitions[t].dst_id;
+        }
+
+        bool reshaped = previous_shaping.font_size != parser.shaping.font_size || previous_shaping.font_hash != parser.shaping.font_hash;
+
+        if (changed == 0 && !renumbered && !reshaped)
+        {
+            std::cout << "'" << output << "' is up to date (" << parser.states.size() << " states)." << std::endl;
+        }
+        else
+        {
+            parser.write_story(output);
+            std::cout << "Wrote " << parser.states.size() << " states (" << changed << " changed) and " << parser.transitions.size() << " transitions";
+            if (parser.shaping.font_size != 0)
+                std::cout << ", shaped into " << parser.glyphs.size() << " glyphs";
+            std::cout << " to '" << output << "'." << std::endl;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
 }
\ No newline at end of file
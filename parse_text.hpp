@@ -24,8 +24,16 @@ struct Parser
     std::unordered_map<hb_codepoint_t, FT_Bitmap> character_atlas;
     std::vector<std::pair<hb_codepoint_t, FT_Bitmap>> character_atlas_vector;
 
-    // State machine for the story
-    std::vector<StateMachine::State> story;
+    // State machine for the story, in the chunks of the binary story format
+    std::vector<char> story_text;
+    std::vector<StateMachine::StateEntry> states;
+    std::vector<StateMachine::TransitionEntry> transitions;
+    std::vector<uint64_t> hashes; // StateMachine::hash_states() of the states
+
+    // Pre-shaped text (left empty unless shape_story() is called)
+    ShapingInfo shaping;
+    std::vector<StateMachine::GlyphRange> glyph_ranges; // One per state, then one per transition
+    std::vector<ShapedGlyph> glyphs;
 
     // Parse a state machine from a file.
     // The expected format is the following:
@@ -34,10 +42,36 @@ struct Parser
     // i {text|j transition_text|k transition_text|...|}
     // ...
     // With i the id of the current state (states should be written in order), text the text to show
-    // when arriving in state i, j the state to transition to and transition text the text to show
-    // when using this transition.
+    // when arriving in state i, j the state to transition to (or -1 for none) and transition text
+    // the text to show when using this transition.
+    // Throws with "file:line:column: message" on errors (columns count bytes).
     void parse_story(const std::string &filename);
 
+    // Shape the text of every state and transition with the given font file and size (in pixels),
+    // so the game only has to break lines and place glyphs. Throws if a character is missing from the font.
+    void shape_story(const std::string &font_filename, uint32_t font_size);
+
+    // Write the parsed story in the binary story format
+    void write_story(const std::string &filename) const;
+
+    // Static analysis of the parsed story graph (every pass is linear in states + transitions)
+    struct Analysis
+    {
+        std::vector<uint32_t> distance;    // Fewest transitions from state 0 to each state (-1U if unreachable)
+        std::vector<uint32_t> unreachable; // States that can't be reached from state 0
+        std::vector<uint32_t> endings;     // Reachable states without any transition leading somewhere
+        std::vector<uint32_t> trapped;     // Reachable states from which no ending can be reached
+        std::vector<uint32_t> component;   // Strongly connected component of each state
+        std::vector<std::vector<uint32_t>> cycles; // Components of reachable states that contain a cycle
+        uint32_t components = 0;           // Number of strongly connected components
+        uint32_t shortest_ending = -1U;    // Fewest transitions from state 0 to an ending (-1U if none)
+        uint32_t longest_path = 0;         // Most transitions between components from state 0, cycles counted once
+    };
+    Analysis analyze_story() const;
+
+    // Write the analysis as a readable report (a summary, then every listed state)
+    void write_report(const Analysis &analysis, std::ostream &out) const;
+
     void get_meshes_from_line(char *line);
 
     Parser();
@@ -2,6 +2,10 @@
 
 #include <iostream>
 #include <vector>
+#include <span>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
 #include <stdexcept>
 #include <cassert>
 
@@ -41,6 +45,79 @@ void read_chunk(std::istream &from, std::string const &magic, std::vector< T > *
 }
 
 
+//ChunkCursor walks through chunks stored in a block of memory (e.g., a MappedFile):
+struct ChunkCursor {
+	ChunkCursor(std::span< char const > data_) : data(data_) { }
+
+	std::span< char const > data;
+	size_t offset = 0; //bytes of data already read
+
+	std::span< char const > remaining() const { return data.subspan(offset); }
+	bool at_end() const { return offset == data.size(); }
+};
+
+//helper function that reads a chunk (same format as above) in place:
+// returns a span pointing directly into the cursor's memory, so nothing is copied.
+// throws if the chunk is truncated, has the wrong magic number, or isn't aligned for T.
+template< typename T >
+std::span< T const > read_chunk(ChunkCursor &from, std::string const &magic) {
+	static_assert(std::is_trivially_copyable_v< T >, "chunks can only hold trivially copyable types");
+
+	struct ChunkHeader {
+		char magic[4] = {'\0', '\0', '\0', '\0'};
+		uint32_t size = 0;
+	};
+	static_assert(sizeof(ChunkHeader) == 8, "header is packed");
+
+	std::span< char const > remaining = from.remaining();
+
+	ChunkHeader header;
+	if (remaining.size() < sizeof(header)) {
+		throw std::runtime_error("Failed to read chunk header");
+	}
+	std::memcpy(&header, remaining.data(), sizeof(header));
+	if (std::string(header.magic,4) != magic) {
+		throw std::runtime_error("Unexpected magic number in chunk");
+	}
+
+	if (header.size % sizeof(T) != 0) {
+		throw std::runtime_error("Size of chunk not divisible by element size");
+	}
+	if (header.size > remaining.size() - sizeof(header)) {
+		throw std::runtime_error("Failed to read chunk data.");
+	}
+
+	char const *begin = remaining.data() + sizeof(header);
+	if (reinterpret_cast< uintptr_t >(begin) % alignof(T) != 0) {
+		throw std::runtime_error("Chunk data is not aligned for its element type");
+	}
+
+	from.offset += sizeof(header) + header.size;
+	return std::span< T const >(reinterpret_cast< T const * >(begin), header.size / sizeof(T));
+}
+
+//same as above, but a chunk that isn't aligned for T is copied to *storage (instead of throwing):
+// the returned span points either into the cursor's memory or into *storage.
+template< typename T >
+std::span< T const > read_chunk(ChunkCursor &from, std::string const &magic, std::vector< T > *storage_) {
+	assert(storage_);
+	auto &storage = *storage_;
+
+	std::span< char const > remaining = from.remaining();
+	if (remaining.size() >= 8 && reinterpret_cast< uintptr_t >(remaining.data() + 8) % alignof(T) != 0) {
+		std::span< char const > bytes = read_chunk< char >(from, magic);
+		if (bytes.size() % sizeof(T) != 0) {
+			throw std::runtime_error("Size of chunk not divisible by element size");
+		}
+		storage.resize(bytes.size() / sizeof(T));
+		if (!bytes.empty()) { //(storage.data() may be null for an empty chunk)
+			std::memcpy(storage.data(), bytes.data(), bytes.size());
+		}
+		return std::span< T const >(storage.data(), storage.size());
+	}
+	return read_chunk< T >(from, magic);
+}
+
 //helper function to write a chunk of data in the same format as read_chunk:
 template< typename T >
 void write_chunk(std::string const &magic, std::vector< T > const &from, std::ostream *to_) {
@@ -0,0 +1,104 @@
+//Stress test for the command queue between the game thread and the audio callback (Sound.cpp), no audio device needed:
+// the main thread plays the game thread, sending set_position / set_volume / play commands in a tight loop,
+// while a second thread plays the audio callback, draining them with Sound::mix_headless() every few milliseconds
+// (slowly enough that the queue keeps filling up).
+// reports commands that were dropped or applied out of order, and how long the game thread was blocked.
+//
+//  $ ./sound-stress [commands] [mix interval in microseconds]
+
+#include "Sound.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char **argv) {
+	uint64_t commands = 5000000;
+	uint32_t mix_interval_us = 2000;
+	if (argc > 1) commands = std::strtoull(argv[1], nullptr, 10);
+	if (argc > 2) mix_interval_us = uint32_t(std::strtoul(argv[2], nullptr, 10));
+	if (argc > 3 || commands == 0) {
+		std::cerr << "Usage:\n\t" << argv[0] << " [commands] [mix interval in microseconds]" << std::endl;
+		return 1;
+	}
+
+	Sound::init_headless();
+
+	//a tenth of a second of sound, so voices keep finishing and being claimed again:
+	Sound::Sample sample(std::vector< float >(4800, 0.1f));
+
+	//Order is checked with the global volume: the game thread sets it to 1, 2, 3, ... (without ramps),
+	// so the values the audio thread sees may skip ahead but must never go back.
+	// (sequence numbers stay below 2^24 so that floats hold them exactly)
+	constexpr uint64_t MaxSequence = 1 << 24;
+
+	std::atomic< bool > done = false;
+	uint64_t out_of_order = 0;
+	uint64_t mixes = 0;
+	float last_seen = 0.0f;
+
+	std::thread audio_thread([&]() {
+		std::vector< float > buffer(2 * 480);
+		while (true) {
+			bool last = done.load(std::memory_order_acquire);
+			Sound::mix_headless(buffer.data(), 480);
+			mixes += 1;
+
+			Sound::lock();
+			float seen = Sound::volume.target;
+			Sound::unlock();
+			if (seen < last_seen) out_of_order += 1;
+			last_seen = seen;
+
+			if (last) break; //(one more mix after the game thread finished, to drain the queue)
+			std::this_thread::sleep_for(std::chrono::microseconds(mix_interval_us));
+		}
+	});
+
+	std::vector< Sound::PlayingSample > playing(16);
+	uint64_t sequence = 0;
+	double max_call_seconds = 0.0;
+
+	auto before = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < commands; ++i) {
+		auto call_before = std::chrono::steady_clock::now();
+		Sound::PlayingSample &handle = playing[i % playing.size()];
+		if (i % 3 == 0 && sequence + 1 < MaxSequence) {
+			sequence += 1;
+			Sound::set_volume(float(sequence), 0.0f);
+		} else if (i % 101 == 1 || handle.stopped()) {
+			handle = Sound::play_3D(sample, 0.5f, glm::vec3(float(i % 7), 0.0f, 0.0f));
+		} else if (i % 3 == 1) {
+			handle.set_position(glm::vec3(float(i % 13), float(i % 5), 0.0f));
+		} else {
+			handle.set_volume(float(i % 10) / 10.0f);
+		}
+		max_call_seconds = std::max(max_call_seconds, std::chrono::duration< double >(std::chrono::steady_clock::now() - call_before).count());
+	}
+	double seconds = std::chrono::duration< double >(std::chrono::steady_clock::now() - before).count();
+
+	done.store(true, std::memory_order_release);
+	audio_thread.join();
+
+	Sound::QueueStats stats = Sound::queue_stats();
+	uint64_t dropped = stats.sent - stats.applied;
+	bool final_ok = (last_seen == float(sequence));
+
+	std::cout << "Sent " << stats.sent << " commands in " << seconds << " s (" << (stats.sent / seconds / 1e6) << " M/s), " << mixes << " mixes." << std::endl;
+	std::cout << "  applied: " << stats.applied << ", dropped: " << dropped << std::endl;
+	std::cout << "  out of order: " << out_of_order << ", last volume seen: " << last_seen << " (sent " << sequence << ")" << std::endl;
+	std::cout << "  queue full: " << stats.full << " times, game thread blocked " << (stats.blocked_seconds * 1e3) << " ms in total, "
+		<< (stats.max_blocked_seconds * 1e3) << " ms at most (slowest call: " << (max_call_seconds * 1e3) << " ms)" << std::endl;
+
+	Sound::shutdown();
+
+	if (dropped != 0 || out_of_order != 0 || !final_ok) {
+		std::cerr << "FAILED: commands were lost or reordered." << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,282 @@
+//Headless benchmark and fuzz harness for the story engine (StateMachine), no window or GL needed:
+// - "walk": random walks through a .story file; reports transitions/sec, allocations per transition, and memory use
+// - "fuzz": loads randomly corrupted copies of a .story file; loading must either succeed or throw
+// - "reload": reloads copies of a .story file with a state inserted; the current state must stay the same
+//
+//  $ ./story-bench walk parsing/story.story [transitions] [seed]
+//  $ ./story-bench fuzz parsing/story.story [iterations] [seed]
+//  $ ./story-bench reload parsing/story.story [rounds] [seed]
+
+#include "StateMachine.hpp"
+#include "read_write_chunk.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+//count every allocation made by the program:
+static std::atomic< uint64_t > allocations = 0;
+
+void *operator new(std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+void operator delete(void *ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+//peak resident set size, in kilobytes (or 0 if unknown on this platform):
+static uint64_t peak_rss_kb() {
+#if defined(_WIN32)
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	#if defined(__APPLE__)
+	return uint64_t(usage.ru_maxrss) / 1024; //reported in bytes
+	#else
+	return uint64_t(usage.ru_maxrss); //reported in kilobytes
+	#endif
+#endif
+}
+
+//take a uniformly random transition out of the current state, or start over at an ending:
+static void random_step(StateMachine &machine, std::mt19937 &mt) {
+	std::span< StateMachine::Transition const > transitions = machine.current_transitions();
+	uint32_t count = 0;
+	for (auto const &transition : transitions) {
+		if (transition.dst_id != -1U) count += 1;
+	}
+	if (count == 0) {
+		machine.reset();
+		return;
+	}
+	//pick the n'th transition that leads somewhere:
+	uint32_t n = mt() % count;
+	for (uint32_t t = 0; t < transitions.size(); ++t) {
+		if (transitions[t].dst_id == -1U) continue;
+		if (n == 0) {
+			machine.switch_state(t);
+			return;
+		}
+		n -= 1;
+	}
+}
+
+static int walk(std::string const &filename, uint64_t transitions, uint32_t seed) {
+	uint64_t baseline_kb = peak_rss_kb();
+
+	StateMachine machine;
+	machine.load(filename);
+	size_t states = machine.get_states().size();
+
+	std::mt19937 mt(seed);
+
+	uint64_t allocations_before = allocations.load();
+	auto before = std::chrono::high_resolution_clock::now();
+	for (uint64_t i = 0; i < transitions; ++i) {
+		random_step(machine, mt);
+	}
+	auto after = std::chrono::high_resolution_clock::now();
+	uint64_t walk_allocations = allocations.load() - allocations_before;
+
+	double seconds = std::chrono::duration< double >(after - before).count();
+
+	std::cout << "walk: '" << filename << "' (" << states << " states, seed " << seed << ", ended in state " << machine.current_state().id << ")\n";
+	std::cout << "  " << transitions << " transitions in " << seconds * 1000.0 << " ms: " << uint64_t(transitions / seconds) << " transitions/sec\n";
+	std::cout << "  allocations: " << double(walk_allocations) / double(transitions) << " per transition\n";
+	std::cout << "  story memory: " << machine.memory_footprint() << " bytes\n";
+	std::cout << "  peak RSS: " << peak_rss_kb() << " kB (" << baseline_kb << " kB before loading)" << std::endl;
+
+	return 0;
+}
+
+static int fuzz(std::string const &filename, uint64_t iterations, uint32_t seed) {
+	std::vector< char > original;
+	{
+		std::ifstream in(filename, std::ios::binary);
+		original.assign(std::istreambuf_iterator< char >(in), std::istreambuf_iterator< char >());
+		if (!in && !in.eof()) throw std::runtime_error("Failed to read '" + filename + "'.");
+	}
+	if (original.empty()) throw std::runtime_error("'" + filename + "' is empty; nothing to fuzz.");
+
+	std::string fuzzed_filename = (std::filesystem::temp_directory_path() / "story-bench-fuzz.story").string();
+
+	std::mt19937 mt(seed);
+	uint64_t accepted = 0;
+	uint64_t rejected = 0;
+
+	for (uint64_t iter = 0; iter < iterations; ++iter) {
+		//corrupt a few bytes, sometimes also cutting the file short:
+		std::vector< char > data = original;
+		uint32_t edits = 1 + mt() % 8;
+		for (uint32_t e = 0; e < edits; ++e) {
+			size_t at = mt() % data.size();
+			switch (mt() % 3) {
+				case 0: data[at] = char(mt()); break; //random byte
+				case 1: data[at] ^= char(1 << (mt() % 8)); break; //flipped bit
+				case 2: data[at] = (mt() % 2 ? char(0xff) : char(0)); break; //extreme value
+			}
+		}
+		if (mt() % 16 == 0) data.resize(mt() % data.size());
+
+		{
+			std::ofstream out(fuzzed_filename, std::ios::binary | std::ios::trunc);
+			out.write(data.data(), data.size());
+		}
+
+		StateMachine machine;
+		try {
+			machine.load(fuzzed_filename);
+		} catch (std::exception &) {
+			rejected += 1;
+			continue;
+		}
+		accepted += 1;
+
+		//anything that loads should be safe to walk:
+		for (uint32_t step = 0; step < 1000; ++step) {
+			random_step(machine, mt);
+		}
+	}
+
+	std::filesystem::remove(fuzzed_filename);
+
+	std::cout << "fuzz: '" << filename << "' (seed " << seed << ")\n";
+	std::cout << "  " << iterations << " corrupted files: " << accepted << " loaded and walked, " << rejected << " rejected" << std::endl;
+
+	return 0;
+}
+
+//write the story of 'machine' to 'filename' with a new state at id 'inserted',
+// renumbering the states after it and the transitions to them (as editing the story source would):
+static void write_with_inserted_state(StateMachine const &machine, uint32_t inserted, std::string const &filename) {
+	std::vector< StateMachine::StateEntry > states;
+	std::vector< StateMachine::TransitionEntry > transitions;
+	std::vector< char > text;
+
+	auto add_text = [&text](std::string_view str, uint32_t *begin, uint32_t *end) {
+		*begin = uint32_t(text.size());
+		text.insert(text.end(), str.begin(), str.end());
+		*end = uint32_t(text.size());
+	};
+	auto add_state = [&](std::string_view state_text, std::span< StateMachine::Transition const > state_transitions) {
+		StateMachine::StateEntry &state = states.emplace_back();
+		add_text(state_text, &state.text_begin, &state.text_end);
+		state.transition_begin = uint32_t(transitions.size());
+		for (auto const &transition : state_transitions) {
+			StateMachine::TransitionEntry &entry = transitions.emplace_back();
+			entry.dst_id = (transition.dst_id == -1U || transition.dst_id < inserted ? transition.dst_id : transition.dst_id + 1);
+			add_text(transition.text, &entry.text_begin, &entry.text_end);
+		}
+		state.transition_end = uint32_t(transitions.size());
+	};
+
+	for (auto const &state : machine.get_states()) {
+		if (state.id == inserted) add_state("(state inserted by story-bench)", {});
+		add_state(state.text, machine.transitions_from(state));
+	}
+	if (inserted == machine.get_states().size()) add_state("(state inserted by story-bench)", {});
+
+	//(no "hsh1" chunk, so the hashes are computed when the file is loaded)
+	std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+	write_chunk("sta0", states, &out);
+	write_chunk("trn0", transitions, &out);
+	write_chunk("str0", text, &out);
+	if (!out) throw std::runtime_error("Failed to write '" + filename + "'.");
+}
+
+static int reload(std::string const &filename, uint64_t rounds, uint32_t seed) {
+	StateMachine original;
+	original.load(filename);
+	uint32_t states = uint32_t(original.get_states().size());
+
+	std::string inserted_filename = (std::filesystem::temp_directory_path() / "story-bench-reload.story").string();
+
+	StateMachine machine;
+	machine.load(filename);
+
+	std::mt19937 mt(seed);
+	uint64_t failures = 0;
+
+	//reload 'file' and check that the machine is still in the state it was in, now expected at id 'expected':
+	auto check = [&](std::string const &file, uint32_t expected, char const *what) {
+		uint32_t before = machine.current_state().id;
+		std::string text(machine.current_state().text);
+		uint32_t changed = machine.reload(file);
+
+		std::vector< uint64_t > const &hashes = machine.state_hashes();
+		uint32_t after = machine.current_state().id;
+		//(states with the same content can't be told apart, so landing on a twin of the expected state is fine)
+		bool same_state = (after < hashes.size() && expected < hashes.size() && hashes[after] == hashes[expected] && machine.current_state().text == text);
+		if (!same_state || changed != 1) {
+			failures += 1;
+			if (failures <= 10) {
+				std::cerr << "  " << what << ": was in state " << before << ", expected state " << expected << ", got state " << after
+				          << (same_state ? "" : " (a different state)") << "; " << changed << " states reported changed instead of 1" << std::endl;
+			}
+		}
+	};
+
+	for (uint64_t round = 0; round < rounds; ++round) {
+		//go somewhere in the story:
+		uint32_t steps = mt() % 64;
+		for (uint32_t step = 0; step < steps; ++step) {
+			random_step(machine, mt);
+		}
+
+		uint32_t inserted = mt() % (states + 1);
+		write_with_inserted_state(original, inserted, inserted_filename);
+
+		uint32_t id = machine.current_state().id;
+		check(inserted_filename, (id < inserted ? id : id + 1), "insert");
+		check(filename, id, "remove");
+	}
+
+	std::filesystem::remove(inserted_filename);
+
+	std::cout << "reload: '" << filename << "' (" << states << " states, seed " << seed << ")\n";
+	std::cout << "  " << rounds << " rounds of inserting and removing a state: " << failures << " reloads lost the current state" << std::endl;
+
+	return (failures == 0 ? 0 : 1);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3 || argc > 5 || !(std::strcmp(argv[1], "walk") == 0 || std::strcmp(argv[1], "fuzz") == 0 || std::strcmp(argv[1], "reload") == 0)) {
+		std::cerr << "Usage:\n\t./story-bench walk <file.story> [transitions] [seed]\n\t./story-bench fuzz <file.story> [iterations] [seed]\n\t./story-bench reload <file.story> [rounds] [seed]" << std::endl;
+		return 1;
+	}
+	std::string mode = argv[1];
+	std::string filename = argv[2];
+	uint64_t count = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : (mode == "walk" ? 10000000 : mode == "fuzz" ? 10000 : 1000));
+	uint32_t seed = (argc > 4 ? uint32_t(std::strtoul(argv[4], nullptr, 10)) : 0x15466);
+
+	try {
+		if (mode == "walk") {
+			return walk(filename, count, seed);
+		} else if (mode == "fuzz") {
+			return fuzz(filename, count, seed);
+		} else {
+			return reload(filename, count, seed);
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+}